@@ -0,0 +1,18 @@
+(set fib
+	 (lambda (n)
+	   (if (= n 0)
+		   0
+		 (if (= n 1)
+			 1
+		   (+ (fib (- n 1)) (fib (- n 2)))))))
+
+(set add
+	 (lambda (a b)
+	   (+ a b)))
+
+(set inputs (quote (27 27 27 27 27 27 27 27 27 27 27 27 27 27 27 27
+					27 27 27 27 27 27 27 27 27 27 27 27 27 27 27 27
+					27 27 27 27 27 27 27 27 27 27 27 27 27 27 27 27
+					27 27 27 27 27 27 27 27 27 27 27 27 27 27 27 27)))
+
+(print (preduce add 0 (pmap fib inputs)))
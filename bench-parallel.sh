@@ -0,0 +1,7 @@
+#!/bin/bash
+# Times bench-parallel.lisp with 1, 2, 4 and 8 workers. Run make first.
+cd "$(dirname "$0")"
+for workers in 1 2 4 8; do
+	TIMEFORMAT="$workers workers: %R s"
+	time ./_lithp --no-cache --workers=$workers bench-parallel.lisp > /dev/null < /dev/null
+done
@@ -0,0 +1,684 @@
+#include "bytecode.h"
+
+#if defined(__GNUC__)
+#define LITHP_COMPUTED_GOTO 1
+#else
+#define LITHP_COMPUTED_GOTO 0
+#endif
+
+/*
+ * COMPILER
+ */
+
+struct Scope {
+	Cell *  params;
+	bool    has_environment;
+	Scope * parent;
+};
+
+Cell * alloc_procedure(Lisp_VM * vm, Cell * source, int arity)
+{
+	Procedure * procedure = (Procedure*) malloc(sizeof(Procedure));
+	procedure->source          = source;
+	procedure->arity           = arity;
+	procedure->max_stack       = 0;
+	procedure->has_environment = false;
+	procedure->code.alloc();
+	procedure->constants.alloc();
+	procedure->calls           = 0;
+	procedure->jit_rejected    = false;
+	procedure->native          = NULL;
+	procedure->native_size     = 0;
+	Cell * cell = alloc_cell(vm, CELL_PROCEDURE);
+	cell->procedure = procedure;
+	DEBUG_TAG(cell, "PROCEDURE");
+	return cell;
+}
+
+static Special_Form form_of(Cell * cell)
+{
+	return cell_type(cell) == CELL_SYMBOL ? cell->symbol->form : FORM_NONE;
+}
+
+/* Conservatively decides whether a lambda body creates closures, in
+ * which case its frame has to outlive the call and is put on the heap.
+ */
+static bool contains_lambda(Lisp_VM * vm, Cell * form)
+{
+	if (cell_type(form) != CELL_CONS || form == vm->nil) return false;
+	if (form_of(form->cons.car) == FORM_QUOTE)  return false;
+	if (form_of(form->cons.car) == FORM_LAMBDA) return true;
+	if (form_of(form->cons.car) == FORM_FUTURE) return true; // Its expression becomes a lambda
+	for (; form != vm->nil; form = form->cons.cdr) {
+		if (contains_lambda(vm, form->cons.car)) return true;
+	}
+	return false;
+}
+
+static int param_index(Lisp_VM * vm, Cell * params, Symbol * symbol)
+{
+	int index = 0;
+	for (; params != vm->nil; params = params->cons.cdr) {
+		if (params->cons.car->symbol == symbol) return index;
+		index++;
+	}
+	return -1;
+}
+
+struct Compiler {
+	Lisp_VM *   vm;
+	Procedure * procedure;
+	Scope *     scope;
+	int         depth;
+
+	void init(Lisp_VM * vm, Procedure * procedure, Scope * scope);
+	void emit(uint8_t byte);
+	void emit_u16(int value);
+	void emit_op(Opcode op, int stack_effect);
+	bool emit_constant(Opcode op, Cell * value, int stack_effect);
+	int  emit_jump(Opcode op, int stack_effect);
+	bool patch_jump(int operand);
+	bool expression(Cell * form, bool tail = false);
+	bool symbol(Cell * symbol);
+	bool special_form(Cell * form, bool tail);
+	bool lambda(Cell * arguments);
+	bool call(Cell * form, bool tail);
+};
+
+void Compiler::init(Lisp_VM * vm, Procedure * procedure, Scope * scope)
+{
+	this->vm        = vm;
+	this->procedure = procedure;
+	this->scope     = scope;
+	depth = 0;
+}
+
+void Compiler::emit(uint8_t byte)
+{
+	procedure->code.push(byte);
+}
+
+void Compiler::emit_u16(int value)
+{
+	emit(value & 0xFF);
+	emit((value >> 8) & 0xFF);
+}
+
+void Compiler::emit_op(Opcode op, int stack_effect)
+{
+	emit(op);
+	depth += stack_effect;
+	if (depth > procedure->max_stack) procedure->max_stack = depth;
+}
+
+bool Compiler::emit_constant(Opcode op, Cell * value, int stack_effect)
+{
+	if (procedure->constants.len > UINT16_MAX) {
+		vm->throw_error("Too many constants in one procedure.\n");
+		return false;
+	}
+	procedure->constants.push(value);
+	emit_op(op, stack_effect);
+	emit_u16(procedure->constants.len - 1);
+	return true;
+}
+
+int Compiler::emit_jump(Opcode op, int stack_effect)
+{
+	emit_op(op, stack_effect);
+	emit_u16(0);
+	return procedure->code.len - 2;
+}
+
+bool Compiler::patch_jump(int operand)
+{
+	int target = procedure->code.len;
+	if (target > UINT16_MAX) {
+		vm->throw_error("Procedure too large to compile.\n");
+		return false;
+	}
+	procedure->code[operand]     = target & 0xFF;
+	procedure->code[operand + 1] = (target >> 8) & 0xFF;
+	return true;
+}
+
+bool Compiler::symbol(Cell * symbol)
+{
+	/* Parameters of the procedure being compiled live in its stack
+	 * frame. Parameters of enclosing procedures are reached through the
+	 * chain of heap frames, where only procedures that create closures
+	 * have a frame.
+	 */
+	int env_depth = 0;
+	for (Scope * s = scope; s != NULL; s = s->parent) {
+		int index = param_index(vm, s->params, symbol->symbol);
+		if (index >= 0) {
+			if (s == scope) {
+				emit_op(OP_LOCAL, 1);
+				emit(index);
+			} else {
+				assert(s->has_environment);
+				emit_op(OP_CAPTURED, 1);
+				emit(env_depth);
+				emit(index);
+			}
+			return true;
+		}
+		if (s->has_environment) env_depth++;
+	}
+	return emit_constant(OP_GLOBAL, symbol, 1);
+}
+
+bool Compiler::lambda(Cell * arguments)
+{
+	if (list_length(vm, arguments) != 2) {
+		vm->throw_error("lambda takes two arguments.\n");
+		return false;
+	}
+	Cell * params = arguments->cons.car;
+	Cell * body   = arguments->cons.cdr->cons.car;
+	if (cell_type(params) != CELL_CONS) {
+		vm->throw_error("lambda parameters must be a list.\n");
+		return false;
+	}
+	for (Cell * param = params; param != vm->nil; param = param->cons.cdr) {
+		if (cell_type(param->cons.car) != CELL_SYMBOL) {
+			vm->throw_error("lambda parameters must be symbols.\n");
+			return false;
+		}
+	}
+	int arity = list_length(vm, params);
+	if (arity > UINT8_MAX) {
+		vm->throw_error("lambda takes at most %d parameters.\n", UINT8_MAX);
+		return false;
+	}
+
+	Cell * cell = alloc_procedure(vm, arguments, arity);
+	Procedure * inner = cell->procedure;
+	inner->has_environment = contains_lambda(vm, body);
+
+	Scope inner_scope;
+	inner_scope.params          = params;
+	inner_scope.has_environment = inner->has_environment;
+	inner_scope.parent          = scope;
+
+	Compiler compiler;
+	compiler.init(vm, inner, &inner_scope);
+	if (!compiler.expression(body, true)) return false;
+	compiler.emit_op(OP_RETURN, -1);
+
+	return emit_constant(OP_CLOSURE, cell, 1);
+}
+
+bool Compiler::special_form(Cell * form, bool tail)
+{
+	Symbol * name = form->cons.car->symbol;
+	Cell * arguments = form->cons.cdr;
+	int arg_count = list_length(vm, arguments);
+
+	Opcode op;
+	int    op_arity = 2;
+	switch (name->form) {
+	case FORM_SET: {
+		if (arg_count != 2) {
+			vm->throw_error("set takes two arguments.\n");
+			return false;
+		}
+		Cell * bind_symbol = arguments->cons.car;
+		if (cell_type(bind_symbol) != CELL_SYMBOL) {
+			vm->throw_error("set must bind a symbol.\n");
+			return false;
+		}
+		if (!expression(arguments->cons.cdr->cons.car)) return false;
+		return emit_constant(OP_SET_GLOBAL, bind_symbol, 0);
+	}
+	case FORM_QUOTE:
+		if (arg_count != 1) {
+			vm->throw_error("quote takes one argument.\n");
+			return false;
+		}
+		return emit_constant(OP_CONSTANT, arguments->cons.car, 1);
+	case FORM_IF: {
+		if (arg_count != 3) {
+			vm->throw_error("if takes three arguments.\n");
+			return false;
+		}
+		if (!expression(list_index(vm, arguments, 0)->cons.car)) return false;
+		int else_jump = emit_jump(OP_JUMP_IF_NIL, -1);
+		if (!expression(list_index(vm, arguments, 1)->cons.car, tail)) return false;
+		int end_jump = emit_jump(OP_JUMP, 0);
+		if (!patch_jump(else_jump)) return false;
+		depth--; // Only one branch leaves its value on the stack
+		if (!expression(list_index(vm, arguments, 2)->cons.car, tail)) return false;
+		return patch_jump(end_jump);
+	}
+	case FORM_PROGN:
+		if (arg_count == 0) {
+			emit_op(OP_NIL, 1);
+			return true;
+		}
+		for (Cell * arg = arguments; arg != vm->nil; arg = arg->cons.cdr) {
+			bool last = arg->cons.cdr == vm->nil;
+			if (!expression(arg->cons.car, tail && last)) return false;
+			if (!last) emit_op(OP_POP, -1);
+		}
+		return true;
+	case FORM_LAMBDA:
+		return lambda(arguments);
+	case FORM_FUTURE: {
+		// The expression is compiled as (lambda () expr), which the future calls on another thread
+		if (arg_count != 1) {
+			vm->throw_error("future takes one argument.\n");
+			return false;
+		}
+		Cell * code = alloc_cell(vm, CELL_CONS);
+		code->cons.car = vm->nil;
+		code->cons.cdr = arguments;
+		if (!lambda(code)) return false;
+		emit_op(OP_PARALLEL, 0);
+		emit(FORM_FUTURE);
+		return true;
+	}
+	// Primitives with a dedicated opcode
+	case FORM_EQUAL: op = OP_EQUAL; break;
+	case FORM_ADD:   op = OP_ADD;   break;
+	case FORM_SUB:   op = OP_SUB;   break;
+	case FORM_MUL:   op = OP_MUL;   break;
+	case FORM_DIV:   op = OP_DIV;   break;
+	case FORM_MOD:   op = OP_MOD;   break;
+	case FORM_SQRT:
+		op = OP_SQRT;
+		op_arity = 1;
+		break;
+	case FORM_PRINT:
+		op = OP_PRINT;
+		op_arity = 1;
+		break;
+	case FORM_GC:
+		op = OP_GC;
+		op_arity = 0;
+		break;
+	case FORM_PMAP:
+	case FORM_PREDUCE:
+	case FORM_TOUCH:
+		op = OP_PARALLEL;
+		op_arity = parallel_form_arity(name->form);
+		break;
+	default:
+		op = OP_VECTOR;
+		op_arity = vector_form_arity(name->form);
+		assert(op_arity >= 0);
+		break;
+	}
+	if (arg_count != op_arity) {
+		vm->throw_error("%s takes %s.\n", name->name, arity_text(op_arity));
+		return false;
+	}
+	for (Cell * arg = arguments; arg != vm->nil; arg = arg->cons.cdr) {
+		if (!expression(arg->cons.car)) return false;
+	}
+	emit_op(op, 1 - op_arity);
+	if (op == OP_VECTOR || op == OP_PARALLEL) emit(name->form);
+	return true;
+}
+
+bool Compiler::call(Cell * form, bool tail)
+{
+	int arg_count = list_length(vm, form->cons.cdr);
+	if (arg_count > UINT8_MAX) {
+		vm->throw_error("Calls take at most %d arguments.\n", UINT8_MAX);
+		return false;
+	}
+	if (!expression(form->cons.car)) return false;
+	for (Cell * arg = form->cons.cdr; arg != vm->nil; arg = arg->cons.cdr) {
+		if (!expression(arg->cons.car)) return false;
+	}
+	// A call in tail position replaces the caller's frame
+	if (!emit_constant(tail ? OP_TAIL_CALL : OP_CALL, NULL, -arg_count)) return false;
+	emit(arg_count);
+	return true;
+}
+
+bool Compiler::expression(Cell * form, bool tail)
+{
+	switch (cell_type(form)) {
+	case CELL_SYMBOL:
+		return symbol(form);
+	case CELL_CONS: {
+		if (form == vm->nil) {
+			emit_op(OP_NIL, 1);
+			return true;
+		}
+		if (form_of(form->cons.car) != FORM_NONE) {
+			return special_form(form, tail);
+		}
+		return call(form, tail);
+	}
+	default:
+		// Everything else evaluates to itself
+		return emit_constant(OP_CONSTANT, form, 1);
+	}
+}
+
+Cell * compile(Lisp_VM * vm, Cell * form)
+{
+	// Procedures under construction aren't reachable from any root
+	vm->gc_inhibit++;
+	defer { vm->gc_inhibit--; };
+	Cell * cell = alloc_procedure(vm, vm->nil, 0);
+	Compiler compiler;
+	compiler.init(vm, cell->procedure, NULL);
+	if (!compiler.expression(form, true)) return NULL;
+	compiler.emit_op(OP_RETURN, -1);
+	return cell;
+}
+
+/*
+ * INTERPRETER
+ */
+
+/* Each call site caches the last lambda it called successfully. The
+ * argument count at a site never changes, so calling the same lambda
+ * again can't fail these checks. Call sites are old, so only old
+ * callees are cached, which keeps them out of the remembered set.
+ */
+static bool check_callee(Lisp_VM * vm, Cell * callee, int arg_count, Cell ** cache)
+{
+	if (cell_type(callee) != CELL_LAMBDA) {
+		vm->throw_error("Attempted to call something that isn't a function.\n");
+		return false;
+	}
+	Procedure * procedure = callee->lambda.code->procedure;
+	if (procedure->arity != arg_count) {
+		vm->throw_error("Function takes %d arguments.\n", procedure->arity);
+		return false;
+	}
+	if (!is_young(callee)) *cache = callee;
+	return true;
+}
+
+Cell * Lisp_VM::execute(Cell * procedure)
+{
+	assert(cell_type(procedure) == CELL_PROCEDURE);
+	if (frame_count >= frame_max ||
+		stack_top + 1 + procedure->procedure->max_stack >= stack_end) {
+		return throw_error("Stack overflow.\n");
+	}
+	// The procedure occupies the callee slot below its (empty) arguments
+	*stack_top++ = procedure;
+	Call_Frame * frame = &frames[frame_count++];
+	frame->procedure = procedure->procedure;
+	frame->ip        = procedure->procedure->code.arr;
+	frame->base      = stack_top;
+	frame->env       = nil;
+	return run(frame_count - 1);
+}
+
+/* Runs until the frame at index entry returns. Registers are cached in
+ * locals and only written back to the Call_Frame on calls.
+ */
+Cell * Lisp_VM::run(int entry)
+{
+	Call_Frame * frame     = &frames[frame_count - 1];
+	uint8_t *    code      = frame->procedure->code.arr;
+	uint8_t *    ip        = frame->ip;
+	Cell **      constants = frame->procedure->constants.arr;
+	Cell **      base      = frame->base;
+	Cell **      sp        = stack_top;
+
+#define READ_U8()  (*ip++)
+#define READ_U16() (ip += 2, (int) (ip[-2] | (ip[-1] << 8)))
+#define PUSH(cell) (*sp++ = (cell))
+#define POP()      (*--sp)
+#define TOP()      (sp[-1])
+// Anything that can allocate may collect, which scans up to stack_top
+#define SYNC()     (stack_top = sp)
+
+#if LITHP_COMPUTED_GOTO
+	static void * dispatch_table[OPCODE_COUNT] = {
+#define X(op) &&do_##op,
+		LITHP_OPCODES(X)
+#undef X
+	};
+#define CASE(op)   do_##op:
+#define DISPATCH() goto *dispatch_table[*ip++]
+	DISPATCH();
+#else
+#define CASE(op)   case op:
+#define DISPATCH() continue
+	while (1) switch (*ip++) {
+#endif
+
+	CASE(OP_CONSTANT) {
+		PUSH(constants[READ_U16()]);
+		DISPATCH();
+	}
+	CASE(OP_NIL) {
+		PUSH(nil);
+		DISPATCH();
+	}
+	CASE(OP_LOCAL) {
+		PUSH(base[READ_U8()]);
+		DISPATCH();
+	}
+	CASE(OP_CAPTURED) {
+		int depth = READ_U8();
+		int slot  = READ_U8();
+		Cell * env = frame->env;
+		while (depth-- > 0) env = env->environment->parent;
+		PUSH(env->environment->values[slot]);
+		DISPATCH();
+	}
+	CASE(OP_GLOBAL) {
+		Symbol * symbol = constants[READ_U16()]->symbol;
+		Cell * value = symbol->value;
+		if (value == NULL) {
+			throw_error("Symbol %s not bound.\n", symbol->name);
+			goto error;
+		}
+		PUSH(value);
+		DISPATCH();
+	}
+	CASE(OP_SET_GLOBAL) {
+		constants[READ_U16()]->symbol->value = TOP();
+		DISPATCH();
+	}
+	CASE(OP_CLOSURE) {
+		SYNC();
+		Cell * closure = alloc_cell(this, CELL_LAMBDA);
+		closure->lambda.code = constants[READ_U16()];
+		closure->lambda.env  = frame->env;
+		DEBUG_TAG(closure, "LAMBDA");
+		PUSH(closure);
+		DISPATCH();
+	}
+	CASE(OP_POP) {
+		sp--;
+		DISPATCH();
+	}
+	CASE(OP_JUMP) {
+		int target = READ_U16();
+		ip = code + target;
+		DISPATCH();
+	}
+	CASE(OP_JUMP_IF_NIL) {
+		int target = READ_U16();
+		Cell * condition = POP();
+		if (condition == nil) {
+			ip = code + target;
+		} else if (condition != truth) {
+			throw_error("if condition didn't resolve to T or NIL.\n");
+			goto error;
+		}
+		DISPATCH();
+	}
+	CASE(OP_CALL) {
+		Cell ** cache = &constants[READ_U16()];
+		int arg_count = READ_U8();
+		Cell * callee = sp[-arg_count - 1];
+		if (callee != *cache && !check_callee(this, callee, arg_count, cache)) goto error;
+		Procedure * procedure = callee->lambda.code->procedure;
+		if (frame_count >= frame_max || sp + procedure->max_stack >= stack_end) {
+			throw_error("Stack overflow.\n");
+			goto error;
+		}
+		frame->ip = ip;
+		frame = &frames[frame_count++];
+		frame->base = sp - arg_count;
+		goto enter_procedure;
+	}
+	CASE(OP_TAIL_CALL) {
+		Cell ** cache = &constants[READ_U16()];
+		int arg_count = READ_U8();
+		Cell * callee = sp[-arg_count - 1];
+		if (callee != *cache && !check_callee(this, callee, arg_count, cache)) goto error;
+		Procedure * procedure = callee->lambda.code->procedure;
+		if (base + arg_count + procedure->max_stack >= stack_end) {
+			throw_error("Stack overflow.\n");
+			goto error;
+		}
+		// Slide the callee and its arguments down over the current frame
+		Cell ** from = sp - arg_count - 1;
+		for (int i = 0; i <= arg_count; i++) base[i - 1] = from[i];
+		sp = base + arg_count;
+		goto enter_procedure;
+	}
+	{
+		/* Shared tail of OP_CALL and OP_TAIL_CALL. Expects frame->base to
+		 * point at the arguments, with the callee just below them.
+		 */
+	enter_procedure:
+		Cell * callee = frame->base[-1];
+		Procedure * procedure = callee->lambda.code->procedure;
+		int arg_count = procedure->arity;
+		if (jit && !procedure->jit_rejected) {
+			if (procedure->native == NULL && ++procedure->calls >= JIT_CALL_THRESHOLD) {
+				jit_compile(this, procedure);
+			}
+			if (procedure->native != NULL) {
+				Cell * result = jit_enter(procedure, frame->base);
+				if (result != NULL) {
+					base = frame->base;
+					sp   = base + arg_count;
+					PUSH(result);
+					goto return_from_frame;
+				}
+				// Nothing has happened yet, so the interpreter can take over from the start
+				jit_release(procedure);
+				procedure->jit_rejected = true;
+			}
+		}
+		frame->procedure = procedure;
+		frame->env       = callee->lambda.env;
+		if (procedure->has_environment) {
+			SYNC();
+			Cell * env = alloc_environment(
+				this, frame->env, procedure->source->cons.car, arg_count);
+			for (int i = 0; i < arg_count; i++) {
+				env->environment->values[i] = frame->base[i];
+			}
+			frame->env = env;
+		}
+		code      = procedure->code.arr;
+		ip        = code;
+		constants = procedure->constants.arr;
+		base      = frame->base;
+		DISPATCH();
+	}
+	CASE(OP_RETURN) {
+	return_from_frame:
+		Cell * result = POP();
+		sp = base - 1; // Drop the arguments and the callee
+		frame_count--;
+		if (frame_count == entry) {
+			stack_top = sp;
+			return result;
+		}
+		PUSH(result);
+		frame     = &frames[frame_count - 1];
+		code      = frame->procedure->code.arr;
+		ip        = frame->ip;
+		constants = frame->procedure->constants.arr;
+		base      = frame->base;
+		DISPATCH();
+	}
+
+#define ARITHMETIC_OP(op, c)					\
+	CASE(op) {									\
+		Cell * b = POP();						\
+		Cell * a = POP();						\
+		SYNC();									\
+		Cell * result = arithmetic(c, a, b);	\
+		if (result == NULL) goto error;			\
+		PUSH(result);							\
+		DISPATCH();								\
+	}
+	ARITHMETIC_OP(OP_ADD, '+')
+	ARITHMETIC_OP(OP_SUB, '-')
+	ARITHMETIC_OP(OP_MUL, '*')
+	ARITHMETIC_OP(OP_DIV, '/')
+	ARITHMETIC_OP(OP_MOD, '%')
+#undef ARITHMETIC_OP
+
+	CASE(OP_SQRT) {
+		Cell * result = square_root(TOP());
+		if (result == NULL) goto error;
+		TOP() = result;
+		DISPATCH();
+	}
+	CASE(OP_EQUAL) {
+		Cell * b = POP();
+		Cell * result = numbers_equal(TOP(), b);
+		if (result == NULL) goto error;
+		TOP() = result;
+		DISPATCH();
+	}
+	CASE(OP_PRINT) {
+		print_value(TOP());
+		DISPATCH();
+	}
+	CASE(OP_VECTOR) {
+		Special_Form form = (Special_Form) READ_U8();
+		int arity = vector_form_arity(form);
+		SYNC();
+		Cell * result = vector_builtin(form, sp - arity);
+		if (result == NULL) goto error;
+		sp -= arity;
+		PUSH(result);
+		DISPATCH();
+	}
+	CASE(OP_PARALLEL) {
+		Special_Form form = (Special_Form) READ_U8();
+		int arity = parallel_form_arity(form);
+		SYNC();
+		Cell * result = parallel_builtin(form, sp - arity);
+		if (result == NULL) goto error;
+		sp -= arity;
+		PUSH(result);
+		DISPATCH();
+	}
+	CASE(OP_GC) {
+		SYNC();
+		PUSH(make_number(this, collect()));
+		DISPATCH();
+	}
+
+#if !LITHP_COMPUTED_GOTO
+	}
+#endif
+
+error:
+	// Unwind everything this invocation pushed
+	stack_top   = frames[entry].base - 1;
+	frame_count = entry;
+	return NULL;
+
+#undef READ_U8
+#undef READ_U16
+#undef PUSH
+#undef POP
+#undef TOP
+#undef SYNC
+#undef CASE
+#undef DISPATCH
+}
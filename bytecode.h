@@ -0,0 +1,105 @@
+#ifndef LITHP_BYTECODE_H
+#define LITHP_BYTECODE_H
+
+#include <stdint.h>
+
+#include "vm.h"
+#include "ds_util.h"
+
+/* Operands follow their opcode inline in the code stream. 16-bit
+ * operands are little-endian, and jump targets are absolute offsets
+ * into the procedure's code.
+ */
+#define LITHP_OPCODES(X)                               \
+	X(OP_CONSTANT)    /* u16 constant               */ \
+	X(OP_NIL)                                          \
+	X(OP_LOCAL)       /* u8 slot                    */ \
+	X(OP_CAPTURED)    /* u8 depth, u8 slot          */ \
+	X(OP_GLOBAL)      /* u16 constant (symbol)      */ \
+	X(OP_SET_GLOBAL)  /* u16 constant (symbol)      */ \
+	X(OP_CLOSURE)     /* u16 constant (procedure)   */ \
+	X(OP_POP)                                          \
+	X(OP_JUMP)        /* u16 target                 */ \
+	X(OP_JUMP_IF_NIL) /* u16 target                 */ \
+	X(OP_CALL)        /* u16 cache, u8 arg count    */ \
+	X(OP_TAIL_CALL)   /* u16 cache, u8 arg count    */ \
+	X(OP_RETURN)                                       \
+	X(OP_ADD)                                          \
+	X(OP_SUB)                                          \
+	X(OP_MUL)                                          \
+	X(OP_DIV)                                          \
+	X(OP_MOD)                                          \
+	X(OP_SQRT)                                         \
+	X(OP_EQUAL)                                        \
+	X(OP_PRINT)                                        \
+	X(OP_GC)                                           \
+	X(OP_VECTOR)      /* u8 form                    */ \
+	X(OP_PARALLEL)    /* u8 form                    */
+
+enum Opcode {
+#define X(op) op,
+	LITHP_OPCODES(X)
+#undef X
+	OPCODE_COUNT
+};
+
+// Opcode and operands, in bytes
+inline int instruction_length(uint8_t op)
+{
+	switch (op) {
+	case OP_LOCAL:
+	case OP_VECTOR:
+	case OP_PARALLEL:
+		return 2;
+	case OP_CONSTANT:
+	case OP_CAPTURED:
+	case OP_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_CLOSURE:
+	case OP_JUMP:
+	case OP_JUMP_IF_NIL:
+		return 3;
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+// Returns NULL to have the interpreter run the call instead (see jit.cc)
+typedef Cell * (*Native_Code)(Cell ** args, long depth);
+
+struct Procedure {
+	Cell *        source;          // ((params...) body), kept for printing
+	int           arity;
+	int           max_stack;       // Deepest the body takes the value stack
+	bool          has_environment; // Closures capture the frame, so it lives on the heap
+	List<uint8_t> code;
+	List<Cell*>   constants;
+	// JIT
+	int           calls;
+	bool          jit_rejected;    // Can't be compiled, or bailed out
+	Native_Code   native;
+	size_t        native_size;
+};
+
+struct Call_Frame {
+	Procedure * procedure;
+	uint8_t *   ip;
+	Cell **     base; // First argument; the callee sits just below it
+	Cell *      env;
+};
+
+// Compiles a top-level form into a procedure taking no arguments
+Cell * compile(Lisp_VM * vm, Cell * form);
+Cell * alloc_procedure(Lisp_VM * vm, Cell * source, int arity);
+
+// Calls made through the interpreter before a procedure is compiled to native code
+#define JIT_CALL_THRESHOLD 100
+
+bool   jit_compile(Lisp_VM * vm, Procedure * procedure);
+Cell * jit_enter(Procedure * procedure, Cell ** args);
+void   jit_release(Procedure * procedure);
+
+#endif
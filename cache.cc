@@ -0,0 +1,346 @@
+#include "lex-parse.h"
+
+#if !DS_PLATFORM_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * FORM CACHE
+ * Each source file loaded from disk gets a .lithpc file beside it
+ * holding the forms it parsed to. The next run reads the forms back
+ * from there instead of lexing and parsing again, as long as the
+ * source still hashes the same.
+ *
+ *   header
+ *   body         one encoded form after another
+ *
+ * Forms are a tag byte followed by its payload. Numbers are zigzag
+ * varints, lists are a varint length and then their items, and each
+ * symbol's name is written once, the first time it appears. After
+ * that it's referred to by the order it first appeared in.
+ */
+
+#define CACHE_MAGIC "LITHPC01"
+
+enum Cache_Tag {
+	CACHE_NIL,
+	CACHE_NUMBER,     // zigzag varint
+	CACHE_LIST,       // varint length, items
+	CACHE_NEW_SYMBOL, // varint name length, name
+	CACHE_SYMBOL,     // varint symbol number
+};
+
+struct Cache_Header {
+	char     magic[8];
+	uint64_t source_hash;
+	uint64_t source_size;
+	uint64_t body_hash; // So a cache is either read whole or not at all
+	uint64_t body_size;
+};
+
+struct Form_Cache {
+	Lisp_VM *     vm;
+	char *        path;
+	Cache_Header  header;
+	bool          fresh;   // Forms come from here rather than the source
+	List<Symbol*> symbols; // By number
+	// Reading
+	char *        data;
+	size_t        size;
+	char *        at;
+	char *        end;
+	// Writing
+	bool          recording;
+	List<char>    body;
+	HashTable<Symbol*, int> numbers;
+};
+
+// FNV-1a a word rather than a byte at a time, so the shift carries high bits back down
+static uint64_t hash_bytes(const char * data, size_t size)
+{
+	uint64_t acc = 14695981039346656037ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		acc ^= word;
+		acc *= 1099511628211ull;
+		acc ^= acc >> 29;
+	}
+	for (; i < size; i++) {
+		acc ^= (uint8_t) data[i];
+		acc *= 1099511628211ull;
+	}
+	return acc ^ (acc >> 32);
+}
+
+static uint32_t hash_symbol(Symbol * symbol)
+{
+	return symbol->hash;
+}
+
+static bool symbol_comp(Symbol * a, Symbol * b)
+{
+	return a == b;
+}
+
+/*
+ * WRITING
+ */
+
+static void emit(Form_Cache * cache, const void * data, int size)
+{
+	cache->body.push_many((char*) data, size);
+}
+
+static void emit_varint(Form_Cache * cache, uint64_t value)
+{
+	uint8_t bytes[10];
+	int len = 0;
+	do {
+		bytes[len] = value & 0x7F;
+		value >>= 7;
+		if (value != 0) bytes[len] |= 0x80;
+		len++;
+	} while (value != 0);
+	emit(cache, bytes, len);
+}
+
+static void emit_tag(Form_Cache * cache, Cache_Tag tag)
+{
+	cache->body.push(tag);
+}
+
+static void emit_form(Form_Cache * cache, Cell * form)
+{
+	Lisp_VM * vm = cache->vm;
+	if (form == vm->nil) {
+		emit_tag(cache, CACHE_NIL);
+		return;
+	}
+	switch (cell_type(form)) {
+	case CELL_NUMBER: {
+		int32_t number = cell_number(form);
+		emit_tag(cache, CACHE_NUMBER);
+		emit_varint(cache, ((uint32_t) number << 1) ^ (uint32_t) (number >> 31));
+		break;
+	}
+	case CELL_SYMBOL: {
+		int number;
+		if (cache->numbers.index(form->symbol, &number) == 0) {
+			emit_tag(cache, CACHE_SYMBOL);
+			emit_varint(cache, number);
+			break;
+		}
+		cache->numbers.insert(form->symbol, cache->symbols.len);
+		cache->symbols.push(form->symbol);
+		int len = strlen(form->symbol->name);
+		emit_tag(cache, CACHE_NEW_SYMBOL);
+		emit_varint(cache, len);
+		emit(cache, form->symbol->name, len);
+		break;
+	}
+	case CELL_CONS: {
+		// The reader only builds proper lists
+		emit_tag(cache, CACHE_LIST);
+		emit_varint(cache, list_length(vm, form));
+		for (Cell * item = form; item != vm->nil; item = item->cons.cdr) {
+			emit_form(cache, item->cons.car);
+		}
+		break;
+	}
+	default:
+		assert(false);
+	}
+}
+
+void cache_record(Form_Cache * cache, Cell * form)
+{
+	if (cache->recording) emit_form(cache, form);
+}
+
+/*
+ * READING
+ */
+
+static bool read_varint(Form_Cache * cache, uint64_t * value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 64 && cache->at < cache->end; shift += 7) {
+		uint8_t byte = *cache->at++;
+		*value |= (uint64_t) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+// Returns NULL if the cache is malformed, which the body hash should rule out
+static Cell * read_form(Form_Cache * cache)
+{
+	Lisp_VM * vm = cache->vm;
+	if (cache->at >= cache->end) return NULL;
+	uint64_t value;
+	switch (*cache->at++) {
+	case CACHE_NIL:
+		return vm->nil;
+	case CACHE_NUMBER:
+		if (!read_varint(cache, &value)) return NULL;
+		return make_number(vm, (int32_t) ((uint32_t) (value >> 1) ^ -(uint32_t) (value & 1)));
+	case CACHE_NEW_SYMBOL: {
+		if (!read_varint(cache, &value) || value > (uint64_t) (cache->end - cache->at)) return NULL;
+		Symbol * symbol = vm->intern(Name { cache->at, (int) value });
+		cache->at += value;
+		cache->symbols.push(symbol);
+		return symbol->cell;
+	}
+	case CACHE_SYMBOL:
+		if (!read_varint(cache, &value) || value >= (uint64_t) cache->symbols.len) return NULL;
+		return cache->symbols[value]->cell;
+	case CACHE_LIST: {
+		if (!read_varint(cache, &value)) return NULL;
+		Cell * list = vm->nil;
+		Cell * last = NULL;
+		for (uint64_t i = 0; i < value; i++) {
+			Cell * item = read_form(cache);
+			if (item == NULL) return NULL;
+			Cell * cons = alloc_cell(vm, CELL_CONS);
+			cons->cons.car = item;
+			cons->cons.cdr = vm->nil;
+			if (last == NULL) list = cons;
+			else              last->cons.cdr = cons;
+			last = cons;
+		}
+		return list;
+	}
+	default:
+		return NULL;
+	}
+}
+
+bool cache_fresh(Form_Cache * cache)
+{
+	return cache->fresh;
+}
+
+Cell * cache_read(Form_Cache * cache)
+{
+	return read_form(cache);
+}
+
+/*
+ * OPENING AND CLOSING
+ */
+
+static char * cache_path_for(char * source_path)
+{
+	// lib.lisp caches to lib.lithpc, and anything else gets .lithpc added
+	int len = strlen(source_path);
+	int stem = len;
+	if (len > 5 && strcmp(source_path + len - 5, ".lisp") == 0) stem = len - 5;
+	char * path = (char*) malloc(stem + sizeof(".lithpc"));
+	memcpy(path, source_path, stem);
+	strcpy(path + stem, ".lithpc");
+	return path;
+}
+
+static bool map_fresh_cache(Form_Cache * cache)
+{
+#if !DS_PLATFORM_WINDOWS
+	int fd = open(cache->path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(Cache_Header)) {
+		close(fd);
+		return false;
+	}
+	void * mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+	Cache_Header header;
+	memcpy(&header, mapping, sizeof(header));
+	char * body = (char*) mapping + sizeof(header);
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.source_hash != cache->header.source_hash ||
+		header.source_size != cache->header.source_size ||
+		header.body_size   != info.st_size - sizeof(header) ||
+		header.body_hash   != hash_bytes(body, header.body_size)) {
+		munmap(mapping, info.st_size);
+		return false;
+	}
+	cache->data = (char*) mapping;
+	cache->size = info.st_size;
+	cache->at   = body;
+	cache->end  = body + header.body_size;
+	return true;
+#else
+	return false;
+#endif
+}
+
+Form_Cache * open_form_cache(Lisp_VM * vm, char * source_path, char * source, size_t source_size)
+{
+	Form_Cache * cache = (Form_Cache*) malloc(sizeof(Form_Cache));
+	cache->vm        = vm;
+	cache->symbols.alloc();
+	cache->data      = NULL;
+	cache->path      = cache_path_for(source_path);
+	memcpy(cache->header.magic, CACHE_MAGIC, sizeof(cache->header.magic));
+	cache->header.source_hash = hash_bytes(source, source_size);
+	cache->header.source_size = source_size;
+
+	cache->fresh = map_fresh_cache(cache);
+	cache->recording = !cache->fresh;
+	if (cache->recording) {
+		// Otherwise forms are gathered as they're parsed, and written out once they all have been
+		cache->body.alloc();
+		cache->numbers.init(256, hash_symbol, symbol_comp);
+	}
+	return cache;
+}
+
+static void write_cache(Form_Cache * cache)
+{
+#if !DS_PLATFORM_WINDOWS
+	/* Written to a file of its own beside the cache and renamed over it,
+	 * so nothing ever sees half a cache, even with several VMs loading
+	 * the same source. Not being able to write one isn't an error.
+	 */
+	cache->header.body_hash = hash_bytes(cache->body.arr, cache->body.len);
+	cache->header.body_size = cache->body.len;
+	char * temp_path = (char*) malloc(strlen(cache->path) + sizeof(".XXXXXX"));
+	defer { free(temp_path); };
+	sprintf(temp_path, "%s.XXXXXX", cache->path);
+	int fd = mkstemp(temp_path);
+	if (fd < 0) return;
+	fchmod(fd, 0644); // mkstemp only lets the owner read it
+	FILE * out = fdopen(fd, "wb");
+	if (out == NULL) {
+		close(fd);
+		remove(temp_path);
+		return;
+	}
+	fwrite(&cache->header, sizeof(cache->header), 1, out);
+	fwrite(cache->body.arr, cache->body.len, 1, out);
+	bool written = !ferror(out);
+	if (fclose(out) == 0 && written) rename(temp_path, cache->path);
+	else                             remove(temp_path);
+#endif
+}
+
+void close_form_cache(Form_Cache * cache, bool complete)
+{
+#if !DS_PLATFORM_WINDOWS
+	if (cache->data != NULL) munmap(cache->data, cache->size);
+#endif
+	if (cache->recording) {
+		if (complete) write_cache(cache);
+		cache->body.dealloc();
+		cache->numbers.dealloc();
+	}
+	free(cache->path);
+	cache->symbols.dealloc();
+	free(cache);
+}
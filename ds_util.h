@@ -156,48 +156,66 @@ struct List {
 
 template <typename K, typename V>
 struct HashPair {
-	K key;
-	V value;
-	bool filled;
+	K        key;
+	V        value;
+	uint32_t hash;      // hash_func(key), so probing and growing needn't rehash
+	bool     filled;
+	bool     tombstone; // Removed, but probes still have to walk past it
 };
 
+/* Open addressing with linear probing. The size is always a power of
+ * two, and the table doubles once it's three quarters full of live
+ * entries and tombstones.
+ */
 template <typename K, typename V>
 struct HashTable {
 	HashPair<K,V> * table;
 	int             table_size;
+	int             count;
+	int             tombstones;
 	
-	int  (*hash_func)(K,int);
-	bool (*key_comp)(K,K);
+	uint32_t (*hash_func)(K);
+	bool     (*key_comp)(K,K);
 
-	void init(int size, int (*hash_func)(K,int), bool (*key_comp)(K,K));
+	void init(int size, uint32_t (*hash_func)(K), bool (*key_comp)(K,K));
+	void dealloc();
 	void insert(K key, V value);
 	int  index(K key, V * value);
+	int  remove(K key);
 	int locate(K key);
+
+	void _resize(int new_size);
 };
 
 template <typename K, typename V>
-void HashTable<K,V>::init(int size, int (*hash_func)(K,int), bool (*key_comp)(K,K))
+void HashTable<K,V>::init(int size, uint32_t (*hash_func)(K), bool (*key_comp)(K,K))
 {
 	this->hash_func = hash_func;
 	this->key_comp = key_comp;
-	table_size = size;
-	table = (HashPair<K,V>*) malloc(sizeof(HashPair<K,V>) * size);
-	for (int i = 0; i < size; i++) {
-		table[i].filled = false;
-	}
+	table_size = 8;
+	while (table_size < size) table_size *= 2;
+	count = 0;
+	tombstones = 0;
+	table = (HashPair<K,V>*) calloc(table_size, sizeof(HashPair<K,V>));
+}
+
+template <typename K, typename V>
+void HashTable<K,V>::dealloc()
+{
+	free(table);
 }
 
 template <typename K, typename V>
 int HashTable<K,V>::locate(K key)
 {
-	int position = hash_func(key, table_size);
-	int counter = 0;
+	uint32_t hash = hash_func(key);
+	int mask = table_size - 1;
+	int position = hash & mask;
 	while (1) {
-		if (!table[position].filled) return -1;
-		if (key_comp(table[position].key, key)) break;
-		
-		if (counter++ >= table_size) return -1;
-		position = (position + 1) % table_size;
+		HashPair<K,V> * pair = &table[position];
+		if (!pair->filled && !pair->tombstone) return -1;
+		if (pair->filled && pair->hash == hash && key_comp(pair->key, key)) break;
+		position = (position + 1) & mask;
 	}
 	return position;
 }
@@ -205,16 +223,33 @@ int HashTable<K,V>::locate(K key)
 template <typename K, typename V>
 void HashTable<K,V>::insert(K key, V value)
 {
-	int position = hash_func(key, table_size);
-	int counter = 0;
-	while (table[position].filled) {
-		if (key_comp(table[position].key, key)) break;
-		assert(counter++ < table_size); // Don't exceed maximum table size
-		position = (position + 1) % table_size;
+	if ((count + tombstones + 1) * 4 > table_size * 3) {
+		// If it's mostly tombstones, clearing them out is enough
+		_resize(count * 2 >= table_size / 2 ? table_size * 2 : table_size);
+	}
+	uint32_t hash = hash_func(key);
+	int mask = table_size - 1;
+	int position = hash & mask;
+	int reuse = -1;
+	while (table[position].filled || table[position].tombstone) {
+		HashPair<K,V> * pair = &table[position];
+		if (pair->filled && pair->hash == hash && key_comp(pair->key, key)) {
+			pair->value = value;
+			return;
+		}
+		if (pair->tombstone && reuse == -1) reuse = position;
+		position = (position + 1) & mask;
 	}
-	table[position].key    = key;
-	table[position].value  = value;
-	table[position].filled = true;
+	if (reuse != -1) {
+		position = reuse;
+		tombstones--;
+	}
+	table[position].key       = key;
+	table[position].value     = value;
+	table[position].hash      = hash;
+	table[position].filled    = true;
+	table[position].tombstone = false;
+	count++;
 }
 
 template <typename K, typename V>
@@ -226,6 +261,36 @@ int HashTable<K,V>::index(K key, V * value)
 	return 0;
 }
 
+template <typename K, typename V>
+int HashTable<K,V>::remove(K key)
+{
+	int position = locate(key);
+	if (position == -1) return 1;
+	table[position].filled    = false;
+	table[position].tombstone = true;
+	count--;
+	tombstones++;
+	return 0;
+}
+
+template <typename K, typename V>
+void HashTable<K,V>::_resize(int new_size)
+{
+	HashPair<K,V> * old_table = table;
+	int old_size = table_size;
+	table_size = new_size;
+	table = (HashPair<K,V>*) calloc(table_size, sizeof(HashPair<K,V>));
+	tombstones = 0;
+	int mask = table_size - 1;
+	for (int i = 0; i < old_size; i++) {
+		if (!old_table[i].filled) continue;
+		int position = old_table[i].hash & mask;
+		while (table[position].filled) position = (position + 1) & mask;
+		table[position] = old_table[i];
+	}
+	free(old_table);
+}
+
 template <typename T>
 void List<T>::alloc()
 {
@@ -543,15 +608,15 @@ char * get_executable_folder_path()
 
 char * load_string_from_file(char * path)
 {
-	FILE * file = fopen(path, "r");
-	defer { fclose(file); };
+	FILE * file = fopen(path, "rb");
 	if (file == NULL) return NULL;
-	int file_len = 0;
-	while (fgetc(file) != EOF) file_len++;
+	defer { fclose(file); };
+	fseek(file, 0, SEEK_END);
+	long file_len = ftell(file);
+	fseek(file, 0, SEEK_SET);
 	char * str = (char*) malloc(file_len + 1);
+	file_len = fread(str, 1, file_len, file);
 	str[file_len] = '\0';
-	fseek(file, 0, SEEK_SET);
-	for (int i = 0; i < file_len; i++) str[i] = fgetc(file);
 	return str;
 }
 
@@ -0,0 +1,367 @@
+#include "vm.h"
+#include "bytecode.h"
+
+/*
+ * ALLOCATION
+ */
+
+static Slab * new_slab(bool young)
+{
+	Slab * slab = (Slab*) aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+	memset(slab->types, CELL_FREE, sizeof(slab->types));
+	memset(slab->marks, 0, sizeof(slab->marks));
+	memset(slab->remembered, 0, sizeof(slab->remembered));
+	slab->young = young;
+	return slab;
+}
+
+static void enter_nursery_slab(Lisp_VM * vm, int index)
+{
+	vm->nursery_slab = index;
+	vm->young_bump   = (Cell*) vm->nursery[index] + SLAB_FIRST_CELL;
+	vm->young_end    = (Cell*) vm->nursery[index] + SLAB_CELLS;
+}
+
+void init_heap(Lisp_VM * vm)
+{
+	vm->nursery.alloc();
+	for (int i = 0; i < NURSERY_SLABS; i++) vm->nursery.push(new_slab(true));
+	enter_nursery_slab(vm, 0);
+	vm->remembered.alloc();
+	vm->slabs.alloc();
+	vm->free_list  = NULL;
+	vm->bump       = NULL;
+	vm->bump_end   = NULL;
+	vm->heap_cells = 0;
+	vm->young_payload = 0;
+	vm->roots.alloc();
+	vm->gc_threshold = GC_MIN_THRESHOLD;
+	vm->gc_inhibit   = 0;
+}
+
+// Vector storage lives outside the slabs, but still counts towards the heap size
+static int payload_cells(Cell * cell, Cell_Type type)
+{
+	if (type != CELL_VECTOR) return 0;
+	return (cell->vector->length * sizeof(int32_t) + sizeof(Cell) - 1) / sizeof(Cell);
+}
+
+void note_payload(Lisp_VM * vm, Cell * cell)
+{
+	if (is_young(cell)) vm->young_payload += payload_cells(cell, cell_type(cell));
+	else                vm->heap_cells    += payload_cells(cell, cell_type(cell));
+}
+
+static Cell * alloc_old(Lisp_VM * vm, Cell_Type type)
+{
+	Cell * cell = vm->free_list;
+	if (cell != NULL) {
+		vm->free_list = cell->cons.car;
+	} else {
+		if (vm->bump == vm->bump_end) {
+			Slab * slab = new_slab(false);
+			vm->slabs.push(slab);
+			vm->bump     = (Cell*) slab + SLAB_FIRST_CELL;
+			vm->bump_end = (Cell*) slab + SLAB_CELLS;
+		}
+		cell = vm->bump++;
+	}
+	slab_of(cell)->types[slab_index(cell)] = type;
+	vm->heap_cells++;
+	return cell;
+}
+
+Cell * alloc_cell(Lisp_VM * vm, Cell_Type type)
+{
+	/* While collection is inhibited nothing may move, so cells go
+	 * straight to the old space. That's where the parser, the compiler
+	 * and the symbol table put what they build, which is long-lived anyway.
+	 */
+	Cell * cell;
+	if (vm->gc_inhibit > 0) {
+		cell = alloc_old(vm, type);
+	} else {
+		bool full = vm->young_bump == vm->young_end;
+		if (full && vm->nursery_slab + 1 < vm->nursery.len) {
+			enter_nursery_slab(vm, vm->nursery_slab + 1);
+		} else if (full || vm->young_payload >= NURSERY_PAYLOAD_MAX) {
+			if (vm->heap_cells >= vm->gc_threshold) vm->collect();
+			else                                    vm->collect_nursery();
+		}
+		cell = vm->young_bump++;
+		slab_of(cell)->types[slab_index(cell)] = type;
+	}
+	DEBUG_TAG(cell, "ALLOCATED");
+	return cell;
+}
+
+static void free_payload(Cell * cell, Cell_Type type)
+{
+	switch (type) {
+	case CELL_ENVIRONMENT:
+		free(cell->environment);
+		break;
+	case CELL_PROCEDURE:
+		cell->procedure->code.dealloc();
+		cell->procedure->constants.dealloc();
+		jit_release(cell->procedure);
+		free(cell->procedure);
+		break;
+	case CELL_VECTOR:
+		free(cell->vector);
+		break;
+	case CELL_FUTURE:
+		free_future(cell->future);
+		break;
+	default:
+		break;
+	}
+}
+
+void free_heap(Lisp_VM * vm)
+{
+	// Every cell still allocated, live or not, has its payload freed with its slab
+	auto free_slabs = [](List<Slab*> & slabs) {
+		for (int i = 0; i < slabs.len; i++) {
+			Cell * cells = (Cell*) slabs[i];
+			for (int index = SLAB_FIRST_CELL; index < (int) SLAB_CELLS; index++) {
+				free_payload(&cells[index], (Cell_Type) slabs[i]->types[index]);
+			}
+			free(slabs[i]);
+		}
+		slabs.dealloc();
+	};
+	free_slabs(vm->nursery);
+	free_slabs(vm->slabs);
+	vm->remembered.dealloc();
+	vm->roots.dealloc();
+}
+
+/* Takes over from's old slabs, cells and all, leaving from with an
+ * empty old space. Nothing in them may point into from's nursery.
+ */
+void adopt_heap(Lisp_VM * vm, Lisp_VM * from)
+{
+	for (int i = 0; i < from->slabs.len; i++) vm->slabs.push(from->slabs[i]);
+	vm->heap_cells += from->heap_cells;
+	from->slabs.len  = 0;
+	from->free_list  = NULL;
+	from->bump       = NULL;
+	from->bump_end   = NULL;
+	from->heap_cells = 0;
+}
+
+/*
+ * TRACING
+ */
+
+// Calls visit on the address of every Cell * held by cell
+template <typename F>
+static void each_slot(Cell * cell, F visit)
+{
+	switch (cell_type(cell)) {
+	case CELL_CONS:
+		visit(&cell->cons.car);
+		visit(&cell->cons.cdr);
+		break;
+	case CELL_LAMBDA:
+		visit(&cell->lambda.code);
+		visit(&cell->lambda.env);
+		break;
+	case CELL_CALL_SITE:
+		visit(&cell->call_site.callee);
+		break;
+	case CELL_ENVIRONMENT: {
+		Environment * frame = cell->environment;
+		visit(&frame->parent);
+		visit(&frame->params);
+		for (int i = 0; i < frame->count; i++) {
+			visit(&frame->values[i]);
+		}
+		break;
+	}
+	case CELL_PROCEDURE: {
+		Procedure * procedure = cell->procedure;
+		visit(&procedure->source);
+		for (int i = 0; i < procedure->constants.len; i++) {
+			visit(&procedure->constants.arr[i]);
+		}
+		break;
+	}
+	case CELL_FUTURE:
+		visit(&cell->future->value);
+		break;
+	default:
+		break;
+	}
+}
+
+// Calls visit on the address of every root
+template <typename F>
+static void each_root(Lisp_VM * vm, F visit)
+{
+	visit(&vm->nil);
+	visit(&vm->truth);
+	// Symbols aren't in the heap, so their global bindings are scanned instead of barriered
+	for (int i = 0; i < vm->symbols.table_size; i++) {
+		if (!vm->symbols.table[i].filled) continue;
+		Symbol * symbol = vm->symbols.table[i].value;
+		visit(&symbol->cell);
+		visit(&symbol->value);
+	}
+	for (int i = 0; i < vm->roots.len; i++) {
+		visit(vm->roots[i]);
+	}
+	for (Cell ** slot = vm->stack; slot < vm->stack_top; slot++) {
+		visit(slot);
+	}
+	for (int i = 0; i < vm->frame_count; i++) {
+		visit(&vm->frames[i].env);
+	}
+}
+
+/*
+ * MINOR COLLECTION
+ */
+
+void Lisp_VM::remember(Cell * cell)
+{
+	Slab * slab  = slab_of(cell);
+	int    index = slab_index(cell);
+	uint64_t bit = (uint64_t) 1 << (index & 63);
+	if (slab->remembered[index >> 6] & bit) return;
+	slab->remembered[index >> 6] |= bit;
+	remembered.push(cell);
+}
+
+void Lisp_VM::collect_nursery()
+{
+	/* Cheney-style: every young cell reachable from the roots or the
+	 * remembered set is copied into the old space, leaving a forwarding
+	 * pointer behind. The copies are then scanned in turn, so the work
+	 * done is proportional to what survives rather than to the nursery.
+	 */
+	List<Cell*> scan;
+	scan.alloc();
+	auto evacuate = [&](Cell ** slot) {
+		Cell * cell = *slot;
+		if (cell == NULL || !is_young(cell)) return;
+		Slab * slab  = slab_of(cell);
+		int    index = slab_index(cell);
+		if (slab->types[index] == CELL_FORWARD) {
+			*slot = cell->cons.car;
+			return;
+		}
+		Cell * copy = alloc_old(this, (Cell_Type) slab->types[index]);
+		*copy = *cell;
+		heap_cells += payload_cells(copy, (Cell_Type) slab->types[index]);
+		slab->types[index] = CELL_FORWARD;
+		cell->cons.car = copy;
+		*slot = copy;
+		scan.push(copy);
+	};
+
+	each_root(this, evacuate);
+	for (int i = 0; i < remembered.len; i++) {
+		Cell * cell  = remembered[i];
+		Slab * slab  = slab_of(cell);
+		int    index = slab_index(cell);
+		slab->remembered[index >> 6] &= ~((uint64_t) 1 << (index & 63));
+		each_slot(cell, evacuate);
+	}
+	remembered.len = 0;
+	while (scan.len > 0) {
+		each_slot(scan.pop(), evacuate);
+	}
+	scan.dealloc();
+
+	// Whatever wasn't forwarded is dead, and only its payload needs freeing
+	for (int i = 0; i <= nursery_slab; i++) {
+		Slab * slab  = nursery[i];
+		Cell * cells = (Cell*) slab;
+		int end = SLAB_CELLS;
+		if (i == nursery_slab) end = young_bump - cells;
+		for (int index = SLAB_FIRST_CELL; index < end; index++) {
+			free_payload(&cells[index], (Cell_Type) slab->types[index]);
+		}
+		memset(slab->types, CELL_FREE, sizeof(slab->types));
+	}
+	enter_nursery_slab(this, 0);
+	young_payload = 0;
+}
+
+/*
+ * FULL COLLECTION
+ */
+
+int Lisp_VM::collect()
+{
+	/* Empties the nursery first, so everything live is in the old
+	 * space. Then marks from the roots with an explicit stack, so long
+	 * lists don't recurse on the native stack, and frees everything
+	 * left unmarked.
+	 */
+	collect_nursery();
+
+	List<Cell*> mark_stack;
+	mark_stack.alloc();
+	auto mark = [&](Cell ** slot) {
+		Cell * cell = *slot;
+		if (cell == NULL || is_fixnum(cell)) return;
+		Slab * slab  = slab_of(cell);
+		int    index = slab_index(cell);
+		uint64_t bit = (uint64_t) 1 << (index & 63);
+		if (slab->marks[index >> 6] & bit) return;
+		slab->marks[index >> 6] |= bit;
+		mark_stack.push(cell);
+	};
+	each_root(this, mark);
+	while (mark_stack.len > 0) {
+		each_slot(mark_stack.pop(), mark);
+	}
+	mark_stack.dealloc();
+
+	/* Sweeps each slab from the top down, so the rebuilt free list hands
+	 * out cells in address order. Slabs left with nothing live go back
+	 * to the system, except the one still being bumped into.
+	 */
+	int live = 0;
+	int kept = 0;
+	free_list = NULL;
+	for (int i = 0; i < slabs.len; i++) {
+		Slab * slab  = slabs[i];
+		Cell * cells = (Cell*) slab;
+		int end = SLAB_CELLS;
+		if (bump > cells && bump <= cells + SLAB_CELLS) end = bump - cells;
+		Cell * head = free_list;
+		int slab_live = 0;
+		for (int index = end - 1; index >= (int) SLAB_FIRST_CELL; index--) {
+			Cell_Type type = (Cell_Type) slab->types[index];
+			if (type != CELL_FREE) {
+				if (slab->marks[index >> 6] & ((uint64_t) 1 << (index & 63))) {
+					slab_live++;
+					live += payload_cells(&cells[index], type);
+					continue;
+				}
+				free_payload(&cells[index], type);
+				slab->types[index] = CELL_FREE;
+			}
+			cells[index].cons.car = head;
+			head = &cells[index];
+		}
+		memset(slab->marks, 0, sizeof(slab->marks));
+		if (slab_live == 0 && end == SLAB_CELLS) {
+			free(slab);
+			continue;
+		}
+		free_list = head;
+		live += slab_live;
+		slabs[kept++] = slab;
+	}
+	slabs.len  = kept;
+	heap_cells = live;
+
+	gc_threshold = live * 2;
+	if (gc_threshold < GC_MIN_THRESHOLD) gc_threshold = GC_MIN_THRESHOLD;
+	return live;
+}
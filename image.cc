@@ -0,0 +1,627 @@
+#include "bytecode.h"
+
+#if !DS_PLATFORM_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * IMAGES
+ * An image holds every symbol, its global binding, and every cell
+ * reachable from those. Cells are numbered and refer to each other by
+ * number, so an image loads into any heap at any address.
+ *
+ *   header
+ *   symbols      u32 name length, name, ref value
+ *   types        u8 per cell
+ *   cells        one record per cell, in number order (see write_cell)
+ *
+ * A ref is one of, by its low bits:
+ *   ...1  a fixnum, as is
+ *   ..10  symbol n's cell, as n << 2 | 2
+ *   ..00  0 for NULL, 4 for NIL, or cell n as (n + 2) << 2
+ * Symbol cells aren't numbered, since each symbol already has one.
+ * Fields are in host byte order; the header records enough to refuse
+ * a foreign image, and a hash of everything after it to refuse a
+ * damaged one.
+ */
+
+#define IMAGE_MAGIC   "LITHPIMG"
+#define IMAGE_VERSION 2
+#define IMAGE_REF_NIL 4
+
+struct Image_Header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t byte_order;   // 0x01020304 as written
+	uint32_t pointer_size;
+	uint32_t interp;       // Closures differ between interpreters, so images do too
+	uint32_t symbol_count;
+	uint32_t cell_count;
+	uint64_t body_hash;
+	uint64_t body_size;
+};
+
+// FNV-1a a word rather than a byte at a time, so the shift carries high bits back down
+static uint64_t hash_bytes(const char * data, size_t size)
+{
+	uint64_t acc = 14695981039346656037ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		acc ^= word;
+		acc *= 1099511628211ull;
+		acc ^= acc >> 29;
+	}
+	for (; i < size; i++) {
+		acc ^= (uint8_t) data[i];
+		acc *= 1099511628211ull;
+	}
+	return acc ^ (acc >> 32);
+}
+
+static uint32_t hash_cell(Cell * cell)
+{
+	uint64_t mixed = (uint64_t) (uintptr_t) cell * 0x9E3779B97F4A7C15ull;
+	return (uint32_t) (mixed >> 32);
+}
+
+static bool cell_comp(Cell * a, Cell * b)
+{
+	return a == b;
+}
+
+static uint32_t hash_symbol(Symbol * symbol)
+{
+	return symbol->hash;
+}
+
+static bool symbol_comp(Symbol * a, Symbol * b)
+{
+	return a == b;
+}
+
+/*
+ * SAVING
+ */
+
+struct Image_Writer {
+	Lisp_VM *                   vm;
+	List<char>                  body; // Everything after the header, which needs its hash
+	HashTable<Symbol*, int>     symbol_numbers;
+	HashTable<Cell*, int>       cell_numbers;
+	List<Cell*>                 cells; // In number order
+
+	void     write(const void * data, size_t size) { body.push_many((char*) data, size); }
+	void     write_u8(uint8_t value)   { write(&value, sizeof(value)); }
+	void     write_u32(uint32_t value) { write(&value, sizeof(value)); }
+	void     write_ref(Cell * cell);
+	void     write_symbol(Symbol * symbol);
+	void     write_cell(Cell * cell);
+	uint64_t ref(Cell * cell);
+	void     number(Cell * cell);
+};
+
+// Gives cell a number if it hasn't got one, so it'll be written out
+void Image_Writer::number(Cell * cell)
+{
+	if (cell == NULL || is_fixnum(cell) || cell == vm->nil) return;
+	if (cell_type(cell) == CELL_SYMBOL) return;
+	int number = 0;
+	if (cell_numbers.index(cell, &number) == 0) return;
+	cell_numbers.insert(cell, cells.len);
+	cells.push(cell);
+}
+
+uint64_t Image_Writer::ref(Cell * cell)
+{
+	if (cell == NULL)     return 0;
+	if (is_fixnum(cell))  return (uint64_t) (uintptr_t) cell;
+	if (cell == vm->nil)  return IMAGE_REF_NIL;
+	int number = 0;
+	if (cell_type(cell) == CELL_SYMBOL) {
+		bool found = symbol_numbers.index(cell->symbol, &number) == 0;
+		assert(found);
+		return (uint64_t) number << 2 | 2;
+	}
+	bool found = cell_numbers.index(cell, &number) == 0;
+	assert(found);
+	return ((uint64_t) number + 2) << 2;
+}
+
+void Image_Writer::write_ref(Cell * cell)
+{
+	uint64_t value = ref(cell);
+	write(&value, sizeof(value));
+}
+
+void Image_Writer::write_symbol(Symbol * symbol)
+{
+	int number = 0;
+	bool found = symbol_numbers.index(symbol, &number) == 0;
+	assert(found);
+	write_u32(number);
+}
+
+void Image_Writer::write_cell(Cell * cell)
+{
+	switch (cell_type(cell)) {
+	case CELL_NUMBER:
+		write_u32(cell->number);
+		break;
+	case CELL_CONS:
+		write_ref(cell->cons.car);
+		write_ref(cell->cons.cdr);
+		break;
+	case CELL_LAMBDA:
+		write_ref(cell->lambda.code);
+		write_ref(cell->lambda.env);
+		break;
+	case CELL_ENVIRONMENT: {
+		Environment * frame = cell->environment;
+		write_ref(frame->parent);
+		write_ref(frame->params);
+		write_u32(frame->count);
+		write_u8(frame->captured);
+		for (int i = 0; i < frame->count; i++) write_ref(frame->values[i]);
+		break;
+	}
+	case CELL_PROCEDURE: {
+		// Native code isn't saved; a loaded procedure earns it again
+		Procedure * procedure = cell->procedure;
+		write_ref(procedure->source);
+		write_u32(procedure->arity);
+		write_u32(procedure->max_stack);
+		write_u8(procedure->has_environment);
+		write_u32(procedure->code.len);
+		write(procedure->code.arr, procedure->code.len);
+		write_u32(procedure->constants.len);
+		for (int i = 0; i < procedure->constants.len; i++) write_ref(procedure->constants[i]);
+		break;
+	}
+	case CELL_VECTOR:
+		write_u32(cell->vector->length);
+		write(cell->vector->data, sizeof(int32_t) * cell->vector->length);
+		break;
+	case CELL_LOCAL:
+		write_symbol(cell->local.symbol);
+		write_u32(cell->local.depth);
+		write_u32(cell->local.index);
+		break;
+	case CELL_CALL_SITE:
+		write_symbol(cell->call_site.symbol);
+		write_ref(cell->call_site.callee);
+		break;
+	default:
+		assert(false);
+	}
+}
+
+bool save_image(Lisp_VM * vm, char * path)
+{
+	FILE * file = fopen(path, "wb");
+	if (file == NULL) {
+		vm->throw_error("Couldn't write image to %s.\n", path);
+		return false;
+	}
+	defer { fclose(file); };
+
+	Image_Writer writer;
+	writer.vm = vm;
+	writer.body.alloc();
+	writer.symbol_numbers.init(vm->symbols.count * 2, hash_symbol, symbol_comp);
+	writer.cell_numbers.init(1024, hash_cell, cell_comp);
+	writer.cells.alloc();
+	defer {
+		writer.symbol_numbers.dealloc();
+		writer.cell_numbers.dealloc();
+		writer.cells.dealloc();
+		writer.body.dealloc();
+	};
+
+	// Numbers every cell reachable from a global binding, breadth first
+	List<Symbol*> symbols;
+	symbols.alloc();
+	defer { symbols.dealloc(); };
+	for (int i = 0; i < vm->symbols.table_size; i++) {
+		if (!vm->symbols.table[i].filled) continue;
+		Symbol * symbol = vm->symbols.table[i].value;
+		writer.symbol_numbers.insert(symbol, symbols.len);
+		symbols.push(symbol);
+		writer.number(symbol->value);
+	}
+	auto number = [&](Cell ** slot) { writer.number(*slot); };
+	for (int i = 0; i < writer.cells.len; i++) {
+		Cell * cell = writer.cells[i];
+		// The same slots each_slot in gc.cc visits
+		switch (cell_type(cell)) {
+		case CELL_CONS:
+			number(&cell->cons.car);
+			number(&cell->cons.cdr);
+			break;
+		case CELL_LAMBDA:
+			number(&cell->lambda.code);
+			number(&cell->lambda.env);
+			break;
+		case CELL_CALL_SITE:
+			number(&cell->call_site.callee);
+			break;
+		case CELL_ENVIRONMENT: {
+			Environment * frame = cell->environment;
+			number(&frame->parent);
+			number(&frame->params);
+			for (int j = 0; j < frame->count; j++) number(&frame->values[j]);
+			break;
+		}
+		case CELL_PROCEDURE: {
+			Procedure * procedure = cell->procedure;
+			number(&procedure->source);
+			for (int j = 0; j < procedure->constants.len; j++) number(&procedure->constants.arr[j]);
+			break;
+		}
+		case CELL_FUTURE:
+			// Its value may not even exist yet
+			vm->throw_error("Futures can't be saved in an image.\n");
+			return false;
+		default:
+			break;
+		}
+	}
+
+	Image_Header header;
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.version      = IMAGE_VERSION;
+	header.byte_order   = 0x01020304;
+	header.pointer_size = sizeof(void*);
+	header.interp       = vm->interp;
+	header.symbol_count = symbols.len;
+	header.cell_count   = writer.cells.len;
+
+	for (int i = 0; i < symbols.len; i++) {
+		int len = strlen(symbols[i]->name);
+		writer.write_u32(len);
+		writer.write(symbols[i]->name, len);
+		writer.write_ref(symbols[i]->value);
+	}
+	for (int i = 0; i < writer.cells.len; i++) {
+		writer.write_u8(cell_type(writer.cells[i]));
+	}
+	for (int i = 0; i < writer.cells.len; i++) {
+		writer.write_cell(writer.cells[i]);
+	}
+	header.body_size = writer.body.len;
+	header.body_hash = hash_bytes(writer.body.arr, writer.body.len);
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(writer.body.arr, writer.body.len, 1, file);
+	if (ferror(file)) {
+		vm->throw_error("Couldn't write image to %s.\n", path);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * LOADING
+ */
+
+struct Image_Reader {
+	Lisp_VM * vm;
+	char *    at;
+	char *    end;
+	bool      truncated;
+	Cell **   cells;
+	uint32_t  cell_count;
+	Symbol ** symbols;
+	uint32_t  symbol_count;
+
+	bool     read(void * data, size_t size);
+	uint8_t  read_u8()  { uint8_t  value = 0; read(&value, sizeof(value)); return value; }
+	uint32_t read_u32() { uint32_t value = 0; read(&value, sizeof(value)); return value; }
+	Cell *   read_ref();
+	Symbol * read_symbol();
+	bool     read_cell(Cell * cell, Cell_Type type);
+};
+
+bool Image_Reader::read(void * data, size_t size)
+{
+	if ((size_t) (end - at) < size) {
+		truncated = true;
+		return false;
+	}
+	memcpy(data, at, size);
+	at += size;
+	return true;
+}
+
+Cell * Image_Reader::read_ref()
+{
+	uint64_t value = 0;
+	read(&value, sizeof(value));
+	if (value == 0)             return NULL;
+	if (value & 1)              return (Cell*) (uintptr_t) value;
+	if (value == IMAGE_REF_NIL) return vm->nil;
+	uint64_t number = value >> 2;
+	if (value & 2) {
+		if (number < symbol_count) return symbols[number]->cell;
+	} else {
+		if (number - 2 < cell_count) return cells[number - 2];
+	}
+	truncated = true;
+	return vm->nil;
+}
+
+Symbol * Image_Reader::read_symbol()
+{
+	uint32_t number = read_u32();
+	if (number >= symbol_count) {
+		truncated = true;
+		return symbols[0];
+	}
+	return symbols[number];
+}
+
+bool Image_Reader::read_cell(Cell * cell, Cell_Type type)
+{
+	switch (type) {
+	case CELL_NUMBER:
+		cell->number = read_u32();
+		break;
+	case CELL_CONS:
+		cell->cons.car = read_ref();
+		cell->cons.cdr = read_ref();
+		break;
+	case CELL_LAMBDA:
+		cell->lambda.code = read_ref();
+		cell->lambda.env  = read_ref();
+		break;
+	case CELL_ENVIRONMENT: {
+		Cell * parent = read_ref();
+		Cell * params = read_ref();
+		uint32_t count = read_u32();
+		if ((size_t) (end - at) < (size_t) count * sizeof(uint64_t)) return false;
+		Environment * frame = (Environment*) malloc(sizeof(Environment) + sizeof(Cell*) * count);
+		frame->parent   = parent;
+		frame->params   = params;
+		frame->count    = count;
+		frame->captured = read_u8();
+		for (uint32_t i = 0; i < count; i++) frame->values[i] = read_ref();
+		cell->environment = frame;
+		break;
+	}
+	case CELL_PROCEDURE: {
+		Procedure * procedure = cell->procedure;
+		procedure->source          = read_ref();
+		procedure->arity           = read_u32();
+		procedure->max_stack       = read_u32();
+		procedure->has_environment = read_u8();
+		uint32_t code_len = read_u32();
+		if ((size_t) (end - at) < code_len) return false;
+		procedure->code.push_many((uint8_t*) at, code_len);
+		at += code_len;
+		uint32_t constant_count = read_u32();
+		if ((size_t) (end - at) < (size_t) constant_count * sizeof(uint64_t)) return false;
+		for (uint32_t i = 0; i < constant_count; i++) procedure->constants.push(read_ref());
+		break;
+	}
+	case CELL_VECTOR: {
+		uint32_t length = read_u32();
+		if ((size_t) (end - at) < (size_t) length * sizeof(int32_t)) return false;
+		cell->vector = (Vector*) malloc(sizeof(Vector) + sizeof(int32_t) * length);
+		cell->vector->length = length;
+		read(cell->vector->data, sizeof(int32_t) * length);
+		note_payload(vm, cell);
+		break;
+	}
+	case CELL_LOCAL:
+		cell->local.symbol = read_symbol();
+		cell->local.depth  = read_u32();
+		cell->local.index  = read_u32();
+		break;
+	case CELL_CALL_SITE:
+		cell->call_site.symbol = read_symbol();
+		cell->call_site.callee = read_ref();
+		break;
+	default:
+		return false;
+	}
+	return !truncated;
+}
+
+static bool is_cell_of(Cell * cell, Cell_Type type)
+{
+	return cell != NULL && cell_type(cell) == type;
+}
+
+/* Checks every instruction reads only its own operands, the procedure's
+ * own constants and arguments, and lands jumps on instructions. Call
+ * site caches are dropped, since a cached callee skips the arity check.
+ */
+static bool valid_procedure(Procedure * procedure)
+{
+	if (procedure->arity < 0 || procedure->arity > 255 || procedure->max_stack < 0) return false;
+	int len = procedure->code.len;
+	uint8_t * code = procedure->code.arr;
+	// 1 where an instruction starts
+	List<uint8_t> starts;
+	starts.alloc();
+	defer { starts.dealloc(); };
+	for (int i = 0; i < len; i++) starts.push(0);
+	int last = -1;
+	for (int at = 0; at < len; at += instruction_length(code[at])) {
+		if (code[at] >= OPCODE_COUNT || at + instruction_length(code[at]) > len) return false;
+		starts[at] = 1;
+		last = at;
+	}
+	if (last < 0 || code[last] != OP_RETURN) return false;
+	for (int at = 0; at < len; at += instruction_length(code[at])) {
+		int operand = instruction_length(code[at]) > 2 ? code[at + 1] | code[at + 2] << 8 : 0;
+		switch (code[at]) {
+		case OP_CONSTANT:
+			if (operand >= procedure->constants.len) return false;
+			break;
+		case OP_GLOBAL:
+		case OP_SET_GLOBAL:
+			if (operand >= procedure->constants.len ||
+				!is_cell_of(procedure->constants[operand], CELL_SYMBOL)) return false;
+			break;
+		case OP_CLOSURE:
+			if (operand >= procedure->constants.len ||
+				!is_cell_of(procedure->constants[operand], CELL_PROCEDURE)) return false;
+			break;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			if (operand >= procedure->constants.len) return false;
+			procedure->constants[operand] = NULL;
+			break;
+		case OP_JUMP:
+		case OP_JUMP_IF_NIL:
+			if (operand >= len || !starts[operand]) return false;
+			break;
+		case OP_LOCAL:
+			if (code[at + 1] >= procedure->arity) return false;
+			break;
+		case OP_VECTOR:
+			if (vector_form_arity((Special_Form) code[at + 1]) < 0) return false;
+			break;
+		case OP_PARALLEL:
+			if (parallel_form_arity((Special_Form) code[at + 1]) < 0) return false;
+			break;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+static bool load_image_from(Lisp_VM * vm, char * data, size_t size, char * path)
+{
+	Image_Header header;
+	if (size < sizeof(header)) return vm->throw_error("%s isn't an image.\n", path);
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0) {
+		return vm->throw_error("%s isn't an image.\n", path);
+	}
+	if (header.version != IMAGE_VERSION || header.byte_order != 0x01020304 ||
+		header.pointer_size != sizeof(void*)) {
+		return vm->throw_error("%s was saved by an incompatible build.\n", path);
+	}
+	if (header.interp != (uint32_t) vm->interp) {
+		return vm->throw_error("%s was saved by the %s interpreter.\n", path,
+			header.interp == INTERP_TREE ? "tree" : "bytecode");
+	}
+	if (header.body_size != size - sizeof(header)) {
+		return vm->throw_error("%s is truncated.\n", path);
+	}
+	if (header.body_hash != hash_bytes(data + sizeof(header), header.body_size)) {
+		return vm->throw_error("%s is corrupt.\n", path);
+	}
+
+	/* Nothing here is reachable from a root until the bindings are set
+	 * at the very end, and cells are filled in after they're all
+	 * allocated, so collection stays off throughout.
+	 */
+	vm->gc_inhibit++;
+	defer { vm->gc_inhibit--; };
+
+	Image_Reader reader;
+	reader.vm           = vm;
+	reader.at           = data + sizeof(header);
+	reader.end          = data + size;
+	reader.truncated    = false;
+	reader.symbol_count = header.symbol_count;
+	reader.cell_count   = header.cell_count;
+	reader.symbols      = (Symbol**) malloc(sizeof(Symbol*) * (header.symbol_count + 1));
+	reader.cells        = (Cell**) malloc(sizeof(Cell*) * (header.cell_count + 1));
+	defer { free(reader.symbols); free(reader.cells); };
+
+	List<char*> values;
+	values.alloc();
+	defer { values.dealloc(); };
+	for (uint32_t i = 0; i < header.symbol_count && !reader.truncated; i++) {
+		uint32_t len = reader.read_u32();
+		if ((size_t) (reader.end - reader.at) < len) {
+			reader.truncated = true;
+			break;
+		}
+		reader.symbols[i] = vm->intern(Name { reader.at, (int) len });
+		reader.at += len;
+		// Refs can't be resolved until every cell exists, so they're read again below
+		values.push(reader.at);
+		reader.at += sizeof(uint64_t);
+	}
+	if (reader.truncated || (size_t) (reader.end - reader.at) < header.cell_count) {
+		return vm->throw_error("%s is truncated.\n", path);
+	}
+
+	uint8_t * types = (uint8_t*) reader.at;
+	reader.at += header.cell_count;
+	for (uint32_t i = 0; i < header.cell_count; i++) {
+		Cell_Type type = (Cell_Type) types[i];
+		if (type == CELL_SYMBOL || type == CELL_FUTURE || type >= CELL_FREE) return vm->throw_error("%s is corrupt.\n", path);
+		if (type == CELL_PROCEDURE) reader.cells[i] = alloc_procedure(vm, vm->nil, 0);
+		else                        reader.cells[i] = alloc_cell(vm, type);
+	}
+	for (uint32_t i = 0; i < header.cell_count; i++) {
+		if (!reader.read_cell(reader.cells[i], (Cell_Type) types[i])) {
+			// The sweep frees payloads by type, so unfilled cells become empty conses
+			for (uint32_t j = i; j < header.cell_count; j++) {
+				if (types[j] == CELL_PROCEDURE) continue;
+				Cell * cell = reader.cells[j];
+				slab_of(cell)->types[slab_index(cell)] = CELL_CONS;
+				cell->cons.car = vm->nil;
+				cell->cons.cdr = vm->nil;
+			}
+			return vm->throw_error("%s is truncated.\n", path);
+		}
+	}
+	// The hash only catches damage, so anything the interpreter trusts is checked too
+	for (uint32_t i = 0; i < header.cell_count; i++) {
+		Cell * cell = reader.cells[i];
+		bool valid = true;
+		if (types[i] == CELL_PROCEDURE) {
+			valid = valid_procedure(cell->procedure);
+		} else if (types[i] == CELL_LAMBDA && vm->interp == INTERP_BYTECODE) {
+			valid = cell->lambda.code != NULL && cell_type(cell->lambda.code) == CELL_PROCEDURE &&
+				(cell->lambda.env == vm->nil || (cell->lambda.env != NULL &&
+				cell_type(cell->lambda.env) == CELL_ENVIRONMENT));
+		}
+		if (!valid) return vm->throw_error("%s is corrupt.\n", path);
+	}
+
+	for (uint32_t i = 0; i < header.symbol_count; i++) {
+		reader.at = values[i];
+		reader.symbols[i]->value = reader.read_ref();
+	}
+	return true;
+}
+
+bool load_image(Lisp_VM * vm, char * path)
+{
+#if !DS_PLATFORM_WINDOWS
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return vm->throw_error("Couldn't open %s.\n", path);
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return vm->throw_error("%s isn't an image.\n", path);
+	}
+	void * mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return vm->throw_error("Couldn't map %s.\n", path);
+	defer { munmap(mapping, info.st_size); };
+	return load_image_from(vm, (char*) mapping, info.st_size, path);
+#else
+	FILE * file = fopen(path, "rb");
+	if (file == NULL) return vm->throw_error("Couldn't open %s.\n", path);
+	defer { fclose(file); };
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char * data = (char*) malloc(size);
+	defer { free(data); };
+	size = fread(data, 1, size, file);
+	return load_image_from(vm, data, size, path);
+#endif
+}
@@ -0,0 +1,418 @@
+#include "bytecode.h"
+
+#include <stddef.h>
+
+/* The JIT reads the slab side table directly, which relies on the
+ * release layout of a Cell.
+ */
+#if defined(__x86_64__) && !LITHP_DEBUG
+#include <sys/mman.h>
+#define LITHP_JIT 1
+#else
+#define LITHP_JIT 0
+#endif
+
+/*
+ * JIT
+ * A baseline compiler from bytecode to x86-64. Each instruction becomes
+ * a fixed template, with the value stack kept on the native stack.
+ * Native code never allocates, has no side effects and raises no
+ * errors. Anything it can't handle (a non-fixnum operand, a callee
+ * that can't be compiled, recursion deeper than JIT_DEPTH_MAX) makes
+ * the whole call return NULL, and the interpreter runs it again from
+ * the start, which is safe because nothing has happened yet.
+ *
+ * Native procedures take a pointer to their first argument in rdi,
+ * with later arguments at lower addresses (the order they're pushed
+ * in), and the remaining depth in rsi. rbx holds the arguments and r12
+ * the depth for the rest of the body.
+ */
+
+#if LITHP_JIT
+
+// Native frames allowed below the one entered from the interpreter
+#define JIT_DEPTH_MAX 10000
+
+// rbp less this is the bottom of the value stack, below the saved registers
+#define FRAME_SAVED 32
+
+struct Assembler {
+	List<uint8_t> code;
+	List<int>     bails;        // rel32 operands that jump to the bail-out
+	List<int>     jumps;        // rel32 operands that jump to a bytecode offset...
+	List<int>     jump_targets; // ...and the offsets they jump to
+
+	void emit(std::initializer_list<uint8_t> bytes);
+	void imm32(int32_t value);
+	void imm64(uint64_t value);
+	void bail_if(std::initializer_list<uint8_t> jump);
+	void jump_to(std::initializer_list<uint8_t> jump, int target);
+	int  skip_if(uint8_t jump);
+	void land(int skip);
+	void call_c(void * function);
+};
+
+void Assembler::emit(std::initializer_list<uint8_t> bytes)
+{
+	for (uint8_t byte : bytes) code.push(byte);
+}
+
+void Assembler::imm32(int32_t value)
+{
+	for (int i = 0; i < 4; i++) code.push(((uint32_t) value >> (i * 8)) & 0xFF);
+}
+
+void Assembler::imm64(uint64_t value)
+{
+	for (int i = 0; i < 8; i++) code.push((value >> (i * 8)) & 0xFF);
+}
+
+void Assembler::bail_if(std::initializer_list<uint8_t> jump)
+{
+	emit(jump);
+	bails.push(code.len);
+	imm32(0);
+}
+
+void Assembler::jump_to(std::initializer_list<uint8_t> jump, int target)
+{
+	emit(jump);
+	jumps.push(code.len);
+	jump_targets.push(target);
+	imm32(0);
+}
+
+// Forward jump over the code up to the matching land(), given its short opcode
+int Assembler::skip_if(uint8_t jump)
+{
+	if (jump == 0xEB) emit({ 0xE9 });
+	else              emit({ 0x0F, (uint8_t) (jump + 0x10) });
+	imm32(0);
+	return code.len;
+}
+
+void Assembler::land(int skip)
+{
+	int32_t rel = code.len - skip;
+	for (int i = 0; i < 4; i++) code[skip - 4 + i] = ((uint32_t) rel >> (i * 8)) & 0xFF;
+}
+
+// Calls a C function, realigning the stack around it since the value stack may not be
+void Assembler::call_c(void * function)
+{
+	emit({ 0x49, 0x89, 0xE5 });             // mov r13, rsp
+	emit({ 0x48, 0x83, 0xE4, 0xF0 });       // and rsp, -16
+	emit({ 0x49, 0xBB }); imm64((uint64_t) function); // mov r11, function
+	emit({ 0x41, 0xFF, 0xD3 });             // call r11
+	emit({ 0x4C, 0x89, 0xEC });             // mov rsp, r13
+}
+
+// Only procedures without side effects or allocation can be re-run after a bail-out
+static bool supported(Procedure * procedure)
+{
+	if (procedure->has_environment) return false;
+	uint8_t * code = procedure->code.arr;
+	for (int ip = 0; ip < procedure->code.len; ip += instruction_length(code[ip])) {
+		switch (code[ip]) {
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_LOCAL:
+		case OP_GLOBAL:
+		case OP_POP:
+		case OP_JUMP:
+		case OP_JUMP_IF_NIL:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_RETURN:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_MOD:
+		case OP_EQUAL:
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+static Native_Code prepare_callee(Procedure * procedure, Lisp_VM * vm)
+{
+	if (procedure->native == NULL && !procedure->jit_rejected) jit_compile(vm, procedure);
+	return procedure->native;
+}
+
+// Pops b into rcx and a into rax, and bails unless both are fixnums
+static void fixnum_operands(Assembler * as)
+{
+	as->emit({ 0x59 });                     // pop rcx
+	as->emit({ 0x58 });                     // pop rax
+	as->emit({ 0x89, 0xC2 });               // mov edx, eax
+	as->emit({ 0x21, 0xCA });               // and edx, ecx
+	as->emit({ 0xF6, 0xC2, 0x01 });         // test dl, 1
+	as->bail_if({ 0x0F, 0x84 });            // jz bail
+}
+
+static void arithmetic(Assembler * as, uint8_t op)
+{
+	// Works on the untagged 32-bit values, so it wraps like the interpreter does
+	fixnum_operands(as);
+	as->emit({ 0x48, 0xD1, 0xF8 });         // sar rax, 1
+	as->emit({ 0x48, 0xD1, 0xF9 });         // sar rcx, 1
+	switch (op) {
+	case OP_ADD:
+		as->emit({ 0x01, 0xC8 });           // add eax, ecx
+		break;
+	case OP_SUB:
+		as->emit({ 0x29, 0xC8 });           // sub eax, ecx
+		break;
+	case OP_MUL:
+		as->emit({ 0x0F, 0xAF, 0xC1 });     // imul eax, ecx
+		break;
+	case OP_DIV:
+	case OP_MOD: {
+		// Division by zero is an error, and -1 is special-cased to avoid INT_MIN / -1
+		as->emit({ 0x85, 0xC9 });           // test ecx, ecx
+		as->bail_if({ 0x0F, 0x84 });        // jz bail
+		as->emit({ 0x83, 0xF9, 0xFF });     // cmp ecx, -1
+		int divide = as->skip_if(0x75);     // jne divide
+		if (op == OP_DIV) as->emit({ 0xF7, 0xD8 }); // neg eax
+		else              as->emit({ 0x31, 0xC0 }); // xor eax, eax
+		int done = as->skip_if(0xEB);       // jmp done
+		as->land(divide);
+		as->emit({ 0x99 });                 // cdq
+		as->emit({ 0xF7, 0xF9 });           // idiv ecx
+		if (op == OP_MOD) as->emit({ 0x89, 0xD0 }); // mov eax, edx
+		as->land(done);
+		break;
+	}
+	}
+	as->emit({ 0x48, 0x63, 0xC0 });         // movsxd rax, eax
+	as->emit({ 0x48, 0x8D, 0x44, 0x00, 0x01 }); // lea rax, [rax + rax + 1]
+	as->emit({ 0x50 });                     // push rax
+}
+
+static void call(Assembler * as, Lisp_VM * vm, Procedure * self, int arg_count, bool tail)
+{
+	as->emit({ 0x48, 0x8B, 0x84, 0x24 }); as->imm32(8 * arg_count); // mov rax, [rsp + callee]
+	// The callee has to be a lambda, found through the slab's type table
+	as->emit({ 0xA8, 0x01 });               // test al, 1
+	as->bail_if({ 0x0F, 0x85 });            // jnz bail
+	as->emit({ 0x48, 0x89, 0xC2 });         // mov rdx, rax
+	as->emit({ 0x48, 0x81, 0xE2 }); as->imm32(-(int32_t) SLAB_SIZE); // and rdx, slab mask
+	as->emit({ 0x48, 0x89, 0xC1 });         // mov rcx, rax
+	as->emit({ 0x48, 0x29, 0xD1 });         // sub rcx, rdx
+	as->emit({ 0x48, 0xC1, 0xE9, 0x04 });   // shr rcx, 4
+	as->emit({ 0x0F, 0xB6, 0x0C, 0x0A });   // movzx ecx, byte [rdx + rcx]
+	as->emit({ 0x83, 0xF9, CELL_LAMBDA });  // cmp ecx, CELL_LAMBDA
+	as->bail_if({ 0x0F, 0x85 });            // jne bail
+	as->emit({ 0x48, 0x8B, 0x00 });         // mov rax, [rax] (lambda.code)
+	as->emit({ 0x48, 0x8B, 0x00 });         // mov rax, [rax] (procedure)
+	as->emit({ 0x81, 0xB8 }); as->imm32(offsetof(Procedure, arity)); as->imm32(arg_count); // cmp [rax + arity], arg_count
+	as->bail_if({ 0x0F, 0x85 });            // jne bail
+	if (tail) {
+		// Calling itself in tail position overwrites the arguments and loops
+		as->emit({ 0x48, 0xB9 }); as->imm64((uint64_t) self); // mov rcx, self
+		as->emit({ 0x48, 0x39, 0xC8 });     // cmp rax, rcx
+		int other = as->skip_if(0x75);      // jne other
+		for (int i = arg_count - 1; i >= 0; i--) {
+			as->emit({ 0x58 });             // pop rax
+			as->emit({ 0x48, 0x89, 0x83 }); as->imm32(-8 * i); // mov [rbx - 8i], rax
+		}
+		as->emit({ 0x48, 0x8D, 0x65, (uint8_t) -FRAME_SAVED }); // lea rsp, [rbp - FRAME_SAVED]
+		as->jump_to({ 0xE9 }, 0);           // jmp to the first instruction
+		as->land(other);
+	}
+	as->emit({ 0x48, 0x8B, 0x88 }); as->imm32(offsetof(Procedure, native)); // mov rcx, [rax + native]
+	as->emit({ 0x48, 0x85, 0xC9 });         // test rcx, rcx
+	int have = as->skip_if(0x75);           // jnz have
+	as->emit({ 0x48, 0x89, 0xC7 });         // mov rdi, rax
+	as->emit({ 0x48, 0xBE }); as->imm64((uint64_t) vm); // mov rsi, vm
+	as->call_c((void*) prepare_callee);
+	as->emit({ 0x48, 0x89, 0xC1 });         // mov rcx, rax
+	as->emit({ 0x48, 0x85, 0xC9 });         // test rcx, rcx
+	as->bail_if({ 0x0F, 0x84 });            // jz bail
+	as->land(have);
+	as->emit({ 0x48, 0x8D, 0xBC, 0x24 }); as->imm32(8 * (arg_count - 1)); // lea rdi, [rsp + first argument]
+	as->emit({ 0x4C, 0x89, 0xE6 });         // mov rsi, r12
+	as->emit({ 0xFF, 0xD1 });               // call rcx
+	as->emit({ 0x48, 0x81, 0xC4 }); as->imm32(8 * (arg_count + 1)); // add rsp, arguments and callee
+	as->emit({ 0x48, 0x85, 0xC0 });         // test rax, rax
+	as->bail_if({ 0x0F, 0x84 });            // jz bail
+	as->emit({ 0x50 });                     // push rax
+}
+
+bool jit_compile(Lisp_VM * vm, Procedure * procedure)
+{
+	if (!supported(procedure)) {
+		procedure->jit_rejected = true;
+		return false;
+	}
+
+	Assembler as;
+	as.code.alloc();
+	as.bails.alloc();
+	as.jumps.alloc();
+	as.jump_targets.alloc();
+	defer {
+		as.code.dealloc();
+		as.bails.dealloc();
+		as.jumps.dealloc();
+		as.jump_targets.dealloc();
+	};
+
+	as.emit({ 0x55 });                      // push rbp
+	as.emit({ 0x48, 0x89, 0xE5 });          // mov rbp, rsp
+	as.emit({ 0x53 });                      // push rbx
+	as.emit({ 0x41, 0x54 });                // push r12
+	as.emit({ 0x41, 0x55 });                // push r13
+	as.emit({ 0x41, 0x56 });                // push r14, keeping rsp 16-byte aligned
+	as.emit({ 0x48, 0x89, 0xFB });          // mov rbx, rdi
+	as.emit({ 0x49, 0x89, 0xF4 });          // mov r12, rsi
+	as.emit({ 0x49, 0x83, 0xEC, 0x01 });    // sub r12, 1
+	as.bail_if({ 0x0F, 0x8C });             // jl bail
+
+	// Native offset of each instruction, for jumps
+	uint8_t * code = procedure->code.arr;
+	int * offsets = (int*) malloc(sizeof(int) * (procedure->code.len + 1));
+	defer { free(offsets); };
+	for (int ip = 0; ip < procedure->code.len; ip += instruction_length(code[ip])) {
+		offsets[ip] = as.code.len;
+		uint8_t * operands = code + ip + 1;
+		int u16 = 0;
+		if (instruction_length(code[ip]) == 3) u16 = operands[0] | (operands[1] << 8);
+		switch (code[ip]) {
+		case OP_CONSTANT:
+			as.emit({ 0x48, 0xB8 }); as.imm64((uint64_t) procedure->constants[u16]); // mov rax, constant
+			as.emit({ 0x50 });              // push rax
+			break;
+		case OP_NIL:
+			as.emit({ 0x48, 0xB8 }); as.imm64((uint64_t) vm->nil); // mov rax, nil
+			as.emit({ 0x50 });              // push rax
+			break;
+		case OP_LOCAL:
+			as.emit({ 0xFF, 0xB3 }); as.imm32(-8 * operands[0]); // push [rbx - 8 * slot]
+			break;
+		case OP_GLOBAL:
+			// Symbols never move, so their value slot can be read directly
+			as.emit({ 0x48, 0xB8 }); as.imm64((uint64_t) procedure->constants[u16]->symbol); // mov rax, symbol
+			as.emit({ 0x48, 0x8B, 0x80 }); as.imm32(offsetof(Symbol, value)); // mov rax, [rax + value]
+			as.emit({ 0x48, 0x85, 0xC0 });  // test rax, rax
+			as.bail_if({ 0x0F, 0x84 });     // jz bail
+			as.emit({ 0x50 });              // push rax
+			break;
+		case OP_POP:
+			as.emit({ 0x48, 0x83, 0xC4, 0x08 }); // add rsp, 8
+			break;
+		case OP_JUMP:
+			as.jump_to({ 0xE9 }, u16);      // jmp target
+			break;
+		case OP_JUMP_IF_NIL:
+			as.emit({ 0x58 });              // pop rax
+			as.emit({ 0x48, 0xB9 }); as.imm64((uint64_t) vm->nil); // mov rcx, nil
+			as.emit({ 0x48, 0x39, 0xC8 });  // cmp rax, rcx
+			as.jump_to({ 0x0F, 0x84 }, u16); // je target
+			as.emit({ 0x48, 0xB9 }); as.imm64((uint64_t) vm->truth); // mov rcx, truth
+			as.emit({ 0x48, 0x39, 0xC8 });  // cmp rax, rcx
+			as.bail_if({ 0x0F, 0x85 });     // jne bail
+			break;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			call(&as, vm, procedure, operands[2], code[ip] == OP_TAIL_CALL);
+			if (code[ip] == OP_TAIL_CALL) {
+				as.emit({ 0x58 });          // pop rax
+				as.jump_to({ 0xE9 }, -1);   // jmp epilogue
+			}
+			break;
+		case OP_RETURN:
+			as.emit({ 0x58 });              // pop rax
+			as.jump_to({ 0xE9 }, -1);       // jmp epilogue
+			break;
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_MOD:
+			arithmetic(&as, code[ip]);
+			break;
+		case OP_EQUAL:
+			// Fixnums are equal exactly when their tagged words are
+			fixnum_operands(&as);
+			as.emit({ 0x48, 0xBA }); as.imm64((uint64_t) vm->truth); // mov rdx, truth
+			as.emit({ 0x48, 0x39, 0xC8 });  // cmp rax, rcx
+			as.emit({ 0x48, 0xB8 }); as.imm64((uint64_t) vm->nil); // mov rax, nil
+			as.emit({ 0x48, 0x0F, 0x44, 0xC2 }); // cmove rax, rdx
+			as.emit({ 0x50 });              // push rax
+			break;
+		}
+	}
+
+	int bail = as.code.len;
+	as.emit({ 0x31, 0xC0 });                // xor eax, eax
+	int epilogue = as.code.len;
+	as.emit({ 0x48, 0x8D, 0x65, (uint8_t) -FRAME_SAVED }); // lea rsp, [rbp - FRAME_SAVED]
+	as.emit({ 0x41, 0x5E });                // pop r14
+	as.emit({ 0x41, 0x5D });                // pop r13
+	as.emit({ 0x41, 0x5C });                // pop r12
+	as.emit({ 0x5B });                      // pop rbx
+	as.emit({ 0x5D });                      // pop rbp
+	as.emit({ 0xC3 });                      // ret
+
+	auto patch = [&](int operand, int target) {
+		int32_t rel = target - (operand + 4);
+		for (int i = 0; i < 4; i++) as.code[operand + i] = ((uint32_t) rel >> (i * 8)) & 0xFF;
+	};
+	for (int i = 0; i < as.bails.len; i++) patch(as.bails[i], bail);
+	for (int i = 0; i < as.jumps.len; i++) {
+		int target = as.jump_targets[i];
+		patch(as.jumps[i], target == -1 ? epilogue : offsets[target]);
+	}
+
+	void * pages = mmap(NULL, as.code.len, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED) {
+		procedure->jit_rejected = true;
+		return false;
+	}
+	memcpy(pages, as.code.arr, as.code.len);
+	mprotect(pages, as.code.len, PROT_READ | PROT_EXEC);
+	procedure->native      = (Native_Code) pages;
+	procedure->native_size = as.code.len;
+	return true;
+}
+
+Cell * jit_enter(Procedure * procedure, Cell ** args)
+{
+	// The interpreter's arguments run upwards, and native code wants them downwards
+	Cell * reversed[UINT8_MAX + 1];
+	int count = procedure->arity;
+	for (int i = 0; i < count; i++) reversed[count - 1 - i] = args[i];
+	return procedure->native(&reversed[count > 0 ? count - 1 : 0], JIT_DEPTH_MAX);
+}
+
+void jit_release(Procedure * procedure)
+{
+	if (procedure->native != NULL) munmap((void*) procedure->native, procedure->native_size);
+	procedure->native = NULL;
+}
+
+#else
+
+bool jit_compile(Lisp_VM * vm, Procedure * procedure)
+{
+	procedure->jit_rejected = true;
+	return false;
+}
+
+Cell * jit_enter(Procedure * procedure, Cell ** args)
+{
+	return NULL;
+}
+
+void jit_release(Procedure * procedure)
+{
+}
+
+#endif
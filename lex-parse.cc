@@ -1,233 +1,442 @@
 #include "lex-parse.h"
 
+#if !DS_PLATFORM_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LITHP_X86 1
+#else
+#define LITHP_X86 0
+#endif
+
 /*
- * LEXER
+ * SCANNING
+ * The lexer spends most of its time finding where runs of whitespace
+ * and words end. So the buffer is classified 64 bytes at a time into a
+ * pair of bitmasks, and the end of a run is the first set bit past the
+ * cursor. The CPU's widest SIMD classifies a whole block in a few
+ * instructions, and a table does it a byte at a time otherwise.
  */
 
-enum Token_Type {
-	TOKEN_OPEN_PAREN,
-	TOKEN_CLOSE_PAREN,
-	TOKEN_IDENTIFIER,
-	TOKEN_LITERAL,
+enum {
+	CHAR_WHITESPACE = 1,
+	CHAR_DELIMITER  = 2, // Whitespace or a paren
 };
 
-union Token_Data {
-	char * identifier;
-	int literal;
+struct Char_Classes {
+	uint8_t of[256];
+	Char_Classes()
+	{
+		memset(of, 0, sizeof(of));
+		of[' ']  = of['\t'] = of['\n'] = CHAR_WHITESPACE | CHAR_DELIMITER;
+		of['(']  = of[')']  = CHAR_DELIMITER;
+	}
 };
 
-struct Token {
-	Token_Type type;
-	Token_Data data;
-	Token() { }
-	Token(Token_Type type) : type(type) { }
-};
+static const Char_Classes char_classes;
 
-void print_token(Token token)
-{
-	switch (token.type) {
-	case TOKEN_OPEN_PAREN:
-		printf("Open Paren (");
-		break;
-	case TOKEN_CLOSE_PAREN:
-		printf("Close Paren )");
-		break;
-	case TOKEN_IDENTIFIER:
-		printf("Identifier: %s", token.data.identifier);
-		break;
-	case TOKEN_LITERAL:
-		printf("Literal: %d", token.data.literal);
-		break;
-	}
-}
-
-struct Lexer {
-	char * source;
-	int source_len;
-	int cursor;
-
-	void init(char * source);
-	char consume();
-	char peek();
-	char * read_word();
-	List<Token> lex();
-};
+// Sets bit i of each mask if text[i] is in that class, for the 64 bytes at text
+typedef void (*Classify_Block)(const char * text, uint64_t * whitespace, uint64_t * delimiters);
 
-void Lexer::init(char * source)
+static void classify_bytes(const char * text, int len, uint64_t * whitespace, uint64_t * delimiters)
 {
-	this->source = source;
-	source_len = strlen(source);
-	cursor = 0;
+	uint64_t w = 0;
+	uint64_t d = 0;
+	for (int i = 0; i < len; i++) {
+		uint64_t classes = char_classes.of[(uint8_t) text[i]];
+		w |= (classes & 1) << i;
+		d |= (classes >> 1) << i;
+	}
+	*whitespace = w;
+	*delimiters = d;
 }
 
-char Lexer::consume()
+// Eight bytes of text as a little-endian word, whatever the host's byte order
+static uint64_t load_word(const char * text)
 {
-	if (cursor >= source_len) return EOF;
-	return source[cursor++];
+	uint64_t word = 0;
+	for (int i = 0; i < 8; i++) word |= (uint64_t) (uint8_t) text[i] << (8 * i);
+	return word;
 }
 
-char Lexer::peek()
+// Sets the high bit of each byte of word that equals c
+static uint64_t bytes_equal(uint64_t word, uint8_t c)
 {
-	if (cursor >= source_len) return EOF;
-	return source[cursor];
+	uint64_t x = word ^ (0x0101010101010101ull * c);
+	return ~(((x & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | x) & 0x8080808080808080ull;
 }
 
-bool is_alpha(char c)
+// Gathers the high bit of each byte into the low eight bits
+static uint64_t high_bits(uint64_t word)
 {
-	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+	return ((word >> 7) * 0x0102040810204080ull) >> 56;
 }
 
-bool is_numeric(char c)
+static void classify_block_scalar(const char * text, uint64_t * whitespace, uint64_t * delimiters)
 {
-	return c >= '0' && c <= '9';
+	// Eight bytes at a time in general purpose registers
+	uint64_t w = 0;
+	uint64_t d = 0;
+	for (int i = 0; i < 64; i += 8) {
+		uint64_t word  = load_word(text + i);
+		uint64_t space = bytes_equal(word, ' ') | bytes_equal(word, '\t') | bytes_equal(word, '\n');
+		uint64_t paren = bytes_equal(word, '(') | bytes_equal(word, ')');
+		w |= high_bits(space) << i;
+		d |= high_bits(space | paren) << i;
+	}
+	*whitespace = w;
+	*delimiters = d;
 }
 
-bool is_int_literal(char * word)
+#if LITHP_X86
+
+#define SSE42 __attribute__((target("sse4.2")))
+#define AVX2  __attribute__((target("avx2")))
+
+SSE42 static void classify_block_sse42(const char * text, uint64_t * whitespace, uint64_t * delimiters)
 {
-	if (*word == '+' || *word == '-') {
-		word++;
-		if (*word == '\0') return false;
+	const __m128i whitespace_set = _mm_setr_epi8(' ', '\t', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i delimiter_set  = _mm_setr_epi8(' ', '\t', '\n', '(', ')', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	const int mode = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+	uint64_t w = 0;
+	uint64_t d = 0;
+	for (int i = 0; i < 64; i += 16) {
+		// Explicit lengths, so a NUL in the source doesn't end the comparison early
+		__m128i chunk = _mm_loadu_si128((const __m128i*) (text + i));
+		w |= (uint64_t) (uint16_t) _mm_cvtsi128_si32(_mm_cmpestrm(whitespace_set, 3, chunk, 16, mode)) << i;
+		d |= (uint64_t) (uint16_t) _mm_cvtsi128_si32(_mm_cmpestrm(delimiter_set,  5, chunk, 16, mode)) << i;
 	}
-	while (*word != '\0') {
-		if (!is_numeric(*word)) return false;
-		word++;
+	*whitespace = w;
+	*delimiters = d;
+}
+
+AVX2 static void classify_block_avx2(const char * text, uint64_t * whitespace, uint64_t * delimiters)
+{
+	uint64_t w = 0;
+	uint64_t d = 0;
+	for (int i = 0; i < 64; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i*) (text + i));
+		__m256i space = _mm256_or_si256(
+			_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')),
+			_mm256_or_si256(
+				_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t')),
+				_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n'))));
+		__m256i parens = _mm256_or_si256(
+			_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('(')),
+			_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(')')));
+		w |= (uint64_t) (uint32_t) _mm256_movemask_epi8(space) << i;
+		d |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(space, parens)) << i;
 	}
-	return true;
+	*whitespace = w;
+	*delimiters = d;
 }
 
-bool is_whitespace(char c)
+#undef SSE42
+#undef AVX2
+
+#endif
+
+static Classify_Block select_classifier()
 {
-	return c == ' ' || c == '\t' || c == '\n';
+	// Build with -DLITHP_NO_SIMD to compare against the scalar classifier
+#if LITHP_X86 && !LITHP_NO_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))   return classify_block_avx2;
+	if (__builtin_cpu_supports("sse4.2")) return classify_block_sse42;
+#endif
+	return classify_block_scalar;
 }
 
-char * Lexer::read_word()
+// Picked before main runs and never changed, so every VM can share it
+static const Classify_Block classify_block = select_classifier();
+
+void Reader::classify(long at)
 {
-	char buffer[512];
-	int buffer_i = 0;
-	while (
-		peek() != '(' &&
-		peek() != ')' &&
-		!is_whitespace(peek()) &&
-		peek() != EOF) {
-		buffer[buffer_i++] = consume();
+	block = at & ~63l;
+	if (block + 64 <= buffer_len) {
+		classify_block(buffer + block, &whitespace, &delimiters);
+		return;
 	}
-	char * word = (char*) malloc(buffer_i + 1);
-	word[buffer_i] = '\0';
-	for (int i = 0; i < buffer_i; i++) word[i] = buffer[i];
-	return word;
+	/* A block running off the end of the buffer is done bytewise, since
+	 * the buffer may end on the last byte of a mapping. Past the end
+	 * counts as a delimiter that isn't whitespace, so every run stops there.
+	 */
+	int len = buffer_len - block;
+	classify_bytes(buffer + block, len, &whitespace, &delimiters);
+	uint64_t beyond = ~(uint64_t) 0 << len;
+	whitespace &= ~beyond;
+	delimiters |= beyond;
 }
 
-List<Token> Lexer::lex()
+// Returns the first index from cursor on whose bit is clear in the chosen mask
+inline long Reader::run_end(bool in_whitespace)
 {
-	List<Token> tokens;
-	tokens.alloc();
-
-	while (1) {
-		char this_char = peek();
-		if (this_char == EOF) {
-			break;
-		} else if (this_char == '(') {
-			tokens.push(Token(TOKEN_OPEN_PAREN));
-			consume();
-		} else if (this_char == ')') {
-			tokens.push(Token(TOKEN_CLOSE_PAREN));
-			consume();
-		} else if (is_whitespace(this_char)) {
-			consume();
-		} else {
-			char * word = read_word();
-			if (is_int_literal(word)) {
-				Token t(TOKEN_LITERAL);
-				t.data.literal = atoi(word);
-				free(word);
-				tokens.push(t);
-			} else {
-				Token t(TOKEN_IDENTIFIER);
-				t.data.identifier = word;
-				tokens.push(t);
-			}
-		}
+	long at = cursor;
+	while (at < buffer_len) {
+		if ((at & ~63l) != block) classify(at);
+		uint64_t rest = (in_whitespace ? ~whitespace : delimiters) >> (at - block);
+		if (rest != 0) return at + __builtin_ctzll(rest);
+		at = block + 64;
 	}
-	return tokens;
+	return buffer_len;
 }
 
 /*
- * PARSER
+ * LEXER
  */
 
-struct Parser {
-	Lisp_VM * vm;
-	Token * tokens;
-	int tokens_len;
-	int cursor;
-	void init(Lisp_VM * vm, Token * tokens, int tokens_len);
-	Token * peek();
-	Token * consume();
-	Cell * parse();
-};
+void Reader::init(Lisp_VM * vm, char * source)
+{
+	this->vm = vm;
+	file = NULL;
+	owns_file = false;
+	prompt = NULL;
+	buffer = source;
+	buffer_len = strlen(source);
+	cursor = 0;
+	mapped_size = 0;
+	block = -1;
+	cache = NULL;
+	word.alloc();
+}
 
-void Parser::init(Lisp_VM * vm, Token * tokens, int tokens_len)
+void Reader::init(Lisp_VM * vm, FILE * file, char * prompt)
 {
 	this->vm = vm;
-	this->tokens = tokens;
-	this->tokens_len = tokens_len;
-	cursor = 0;	
+	this->file = file;
+	owns_file = false;
+	this->prompt = prompt;
+	buffer = (char*) malloc(READER_BUFFER_SIZE);
+	buffer_len = 0;
+	cursor = 0;
+	mapped_size = 0;
+	block = -1;
+	cache = NULL;
+	word.alloc();
+}
+
+bool Reader::open(Lisp_VM * vm, char * path)
+{
+#if !DS_PLATFORM_WINDOWS
+	/* Regular files are mapped and lexed in place, so loading one costs
+	 * no copies and no reads beyond faulting the pages in.
+	 */
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		void * mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping != MAP_FAILED) {
+			madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+			init(vm, "");
+			buffer = (char*) mapping;
+			buffer_len = info.st_size;
+			mapped_size = info.st_size;
+			if (vm->caching) cache = open_form_cache(vm, path, buffer, buffer_len);
+			return true;
+		}
+	} else {
+		close(fd);
+	}
+#endif
+	// Pipes, empty files and anything else that can't be mapped are streamed
+	FILE * stream = fopen(path, "r");
+	if (stream == NULL) return false;
+	init(vm, stream, NULL);
+	owns_file = true;
+	return true;
+}
+
+void Reader::dealloc()
+{
+#if !DS_PLATFORM_WINDOWS
+	if (mapped_size > 0) munmap(buffer, mapped_size);
+#endif
+	if (cache != NULL) close_form_cache(cache, false);
+	if (file != NULL) free(buffer);
+	if (owns_file) fclose(file);
+	word.dealloc();
+}
+
+bool Reader::fill()
+{
+	// Streams are read a line at a time, so the REPL sees each line as it's typed
+	if (file == NULL) return false;
+	if (prompt != NULL) {
+		printf("%s", prompt);
+		fflush(stdout);
+	}
+	if (fgets(buffer, READER_BUFFER_SIZE, file) == NULL) return false;
+	buffer_len = strlen(buffer);
+	cursor = 0;
+	block = -1;
+	return buffer_len > 0;
+}
+
+int Reader::peek()
+{
+	if (cursor == buffer_len && !fill()) return EOF;
+	return (uint8_t) buffer[cursor];
+}
+
+bool is_alpha(char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
 }
 
-Token * Parser::peek()
+bool is_numeric(char c)
 {
-	if (cursor >= tokens_len) return NULL;
-	return tokens + cursor;
+	return c >= '0' && c <= '9';
 }
 
-Token * Parser::consume()
+// Eight ASCII digits in a little-endian word, most significant first, to their value
+static uint32_t parse_eight_digits(uint64_t digits)
 {
-	if (cursor >= tokens_len) return NULL;
-	return tokens + cursor++;
+	digits -= 0x3030303030303030ull;
+	digits = digits * 10 + (digits >> 8);
+	digits = ((digits & 0x000000FF000000FFull) * (100 + (1000000ull << 32)) +
+		((digits >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32))) >> 32;
+	return (uint32_t) digits;
 }
 
-Cell * Parser::parse()
+/* Parses a whole word as a decimal integer, wrapping on overflow like
+ * atoi did. When eight bytes can be read from the first digit without
+ * passing end, up to eight digits are checked and converted at once.
+ */
+static bool parse_int_literal(Name word, const char * end, int * literal)
 {
-	Cell * this_cons = vm->nil;
+	int i = 0;
+	bool negative = word.str[0] == '-';
+	if (negative || word.str[0] == '+') {
+		i++;
+		if (word.len == 1) return false;
+	}
+	const char * digits = word.str + i;
+	int count = word.len - i;
+	uint32_t value = 0;
+	if (count <= 8 && digits + 8 <= end) {
+		// Pads on the left with '0's, so the digits fill the word
+		uint64_t chunk = load_word(digits) << (8 * (8 - count));
+		if (count < 8) chunk |= 0x3030303030303030ull >> (8 * count);
+		if (((chunk + 0x4646464646464646ull) | (chunk - 0x3030303030303030ull)) & 0x8080808080808080ull) {
+			return false;
+		}
+		value = parse_eight_digits(chunk);
+	} else {
+		for (int j = 0; j < count; j++) {
+			uint32_t digit = (uint8_t) digits[j] - '0';
+			if (digit > 9) return false;
+			value = value * 10 + digit;
+		}
+	}
+	*literal = (int) (negative ? -value : value);
+	return true;
+}
+
+bool is_whitespace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+bool is_delimiter(char c)
+{
+	return c == '(' || c == ')' || is_whitespace(c);
+}
 
+int Reader::skip_whitespace()
+{
 	while (1) {
-		Token * token = consume();
-		if (token == NULL || token->type == TOKEN_CLOSE_PAREN) {
-			break;
-		} else if (token->type == TOKEN_IDENTIFIER) {
-			Cell * symbol = alloc_cell();
-			symbol->cell_type = CELL_SYMBOL;
-			symbol->symbol = token->data.identifier;
-			this_cons = cell_push(vm, this_cons, symbol);
-		} else if (token->type == TOKEN_LITERAL) {
-			Cell * number = alloc_cell();
-			number->cell_type = CELL_NUMBER;
-			number->number = token->data.literal;
-			this_cons = cell_push(vm, this_cons, number);
-		} else if (token->type == TOKEN_OPEN_PAREN) {
-			Cell * cons = parse();
-			this_cons = cell_push(vm, this_cons, cons);
+		cursor = run_end(true);
+		if (cursor < buffer_len) return (uint8_t) buffer[cursor];
+		if (!fill()) return EOF;
+	}
+}
+
+Cell * Reader::read_word()
+{
+	long start = cursor;
+	cursor = run_end(false);
+	Name name = { buffer + start, (int) (cursor - start) };
+	char * end = buffer + buffer_len;
+	if (cursor == buffer_len && file != NULL) {
+		// The next fill overwrites the buffer, so a word that may carry on past it is copied out
+		word.len = 0;
+		word.push_many(name.str, name.len);
+		int c;
+		while ((c = peek()) != EOF && !is_delimiter(c)) {
+			word.push(c);
+			cursor++;
 		}
+		name = Name { word.arr, word.len };
+		end  = word.arr + word.len;
 	}
+	int literal;
+	if (parse_int_literal(name, end, &literal)) return make_number(vm, literal);
+	return vm->intern(name)->cell;
+}
+
+/*
+ * PARSER
+ */
 
-	return this_cons;
+Cell * Reader::read_list()
+{
+	// Each cons is appended through the last one, so the list is built in one pass
+	Cell * list = vm->nil;
+	Cell * last = NULL;
+	while (1) {
+		int c = skip_whitespace();
+		if (c == EOF) break; // Lists left open are closed by the end of the input
+		if (c == ')') {
+			cursor++;
+			break;
+		}
+		Cell * item = read_item();
+		Cell * cons = alloc_cell(vm, CELL_CONS);
+		cons->cons.car = item;
+		cons->cons.cdr = vm->nil;
+		if (last == NULL) list = cons;
+		else              last->cons.cdr = cons;
+		last = cons;
+	}
+	return list;
 }
 
-Cell * parse_source(Lisp_VM * vm, char * source)
+Cell * Reader::read_item()
 {
-	List<Token> tokens;
-	{
-		Lexer lexer;
-		lexer.init(source);
-		tokens = lexer.lex();
+	if (peek() == '(') {
+		cursor++;
+		return read_list();
 	}
-	
-	Cell * parsed;
-	{
-		Parser parser;
-		parser.init(vm, tokens.arr, tokens.len);
-		parsed = parser.parse();
+	return read_word();
+}
+
+Cell * Reader::read()
+{
+	// Nothing is rooted until the whole form has been built
+	vm->gc_inhibit++;
+	defer { vm->gc_inhibit--; };
+	if (cache != NULL && cache_fresh(cache)) return cache_read(cache);
+	while (1) {
+		int c = skip_whitespace();
+		if (c == EOF) {
+			if (cache != NULL) {
+				close_form_cache(cache, true);
+				cache = NULL;
+			}
+			return NULL;
+		}
+		if (c != ')') {
+			Cell * form = read_item();
+			if (cache != NULL) cache_record(cache, form);
+			return form;
+		}
+		// A stray close paren closes nothing
+		cursor++;
 	}
-	
-	return parsed;
 }
@@ -10,6 +10,67 @@
 #include "vm.h"
 #include "ds_util.h"
 
-Cell * parse_source(Lisp_VM * vm, char * source);
+#define READER_BUFFER_SIZE (64 * 1024)
+
+// Parsed forms saved beside a source file (see cache.cc)
+struct Form_Cache;
+
+// Returns a cache that either has fresh forms to read or records them
+Form_Cache * open_form_cache(Lisp_VM * vm, char * source_path, char * source, size_t source_size);
+// Only a complete cache replaces the old one
+void         close_form_cache(Form_Cache * cache, bool complete);
+bool         cache_fresh(Form_Cache * cache);
+// Returns NULL once the cached forms run out
+Cell *       cache_read(Form_Cache * cache);
+void         cache_record(Form_Cache * cache, Cell * form);
+
+/* Reads one top-level form at a time, straight from a string, a mapped
+ * file or a stream. Only a buffer's worth of a stream is held at once,
+ * plus any word that runs past the end of it.
+ */
+struct Reader {
+	Lisp_VM *  vm;
+	FILE *     file;        // NULL unless reading a stream
+	bool       owns_file;
+	char *     prompt;      // Printed before each line is read from file, if set
+	char *     buffer;
+	long       buffer_len;
+	long       cursor;
+	size_t     mapped_size; // Non-zero when buffer is a mapping of the whole file
+	List<char> word;        // Words cut off by the end of the buffer are gathered here
+	// Classes of the 64 bytes of buffer from block on, a bit per byte (see lex-parse.cc)
+	long       block;
+	uint64_t   whitespace;
+	uint64_t   delimiters;
+	Form_Cache * cache;     // Forms are read from or recorded to this, if set
+
+	void   init(Lisp_VM * vm, char * source);
+	void   init(Lisp_VM * vm, FILE * file, char * prompt);
+	// Returns false if path can't be opened
+	bool   open(Lisp_VM * vm, char * path);
+	void   dealloc();
+	// Returns NULL once the input runs out
+	Cell * read();
+
+	bool   fill();
+	int    peek();
+	void   classify(long at);
+	long   run_end(bool in_whitespace);
+	int    skip_whitespace();
+	Cell * read_word();
+	Cell * read_list();
+	Cell * read_item();
+};
+
+/* Reads and parses files on worker threads, ahead of their turn to be
+ * evaluated (see parallel.cc).
+ */
+struct Loader;
+
+// Returns NULL if there's nothing to gain, and the files should just be read in turn
+Loader * start_loading(Lisp_VM * vm, char ** paths, int count);
+// Waits for the index'th file, and returns its forms as a list in vm, or NULL if it can't be opened
+Cell *   take_loaded(Loader * loader, int index);
+void     stop_loading(Loader * loader);
 
 #endif
@@ -1,412 +1,819 @@
 #include <math.h>
 
 #include "lex-parse.h"
+#include "bytecode.h"
 
 #define DS_UTIL_IMPLEMENTATION
 #include "ds_util.h"
 
-bool string_in_list(char ** list, int list_len, char * str)
-{
-	for (int i = 0; i < list_len; i++) {
-		if (strcmp(list[i], str) == 0) return true;
-	}
-	return false;
-}
+struct Special_Form_Name {
+	char *       name;
+	Special_Form form;
+};
 
-#define SPECIAL_FORM_COUNT 13
-char * special_forms[SPECIAL_FORM_COUNT] = {
+#define SPECIAL_FORM_COUNT 29
+const Special_Form_Name special_forms[SPECIAL_FORM_COUNT] = {
 	// Essential
-	"set",
-	"quote",
-	"if",
-	"=",
-	"progn",
+	{ "set",    FORM_SET },
+	{ "quote",  FORM_QUOTE },
+	{ "if",     FORM_IF },
+	{ "=",      FORM_EQUAL },
+	{ "progn",  FORM_PROGN },
+	{ "lambda", FORM_LAMBDA },
 	// Builtin math
-	"+",
-	"-",
-	"*",
-	"/",
-	"%",
-	"mod",
-	"sqrt",
+	{ "+",      FORM_ADD },
+	{ "-",      FORM_SUB },
+	{ "*",      FORM_MUL },
+	{ "/",      FORM_DIV },
+	{ "%",      FORM_MOD },
+	{ "mod",    FORM_MOD },
+	{ "sqrt",   FORM_SQRT },
 	// I/O
-	"print",
+	{ "print",  FORM_PRINT },
+	// Memory
+	{ "gc",     FORM_GC },
+	// Vectors
+	{ "make-vector", FORM_MAKE_VECTOR },
+	{ "vector-ref",  FORM_VECTOR_REF },
+	{ "vector-set!", FORM_VECTOR_SET },
+	{ "length",      FORM_LENGTH },
+	{ "vsum",        FORM_VSUM },
+	{ "vdot",        FORM_VDOT },
+	{ "v+",          FORM_VADD },
+	{ "vmap-scale",  FORM_VSCALE },
+	{ "vmin",        FORM_VMIN },
+	{ "vmax",        FORM_VMAX },
+	// Parallel
+	{ "pmap",        FORM_PMAP },
+	{ "preduce",     FORM_PREDUCE },
+	{ "future",      FORM_FUTURE },
+	{ "touch",       FORM_TOUCH },
 };
 
-int hash_str(char * key, int table_size)
+uint32_t name_hash(Name key)
+{
+	// FNV-1a
+	uint32_t acc = 2166136261u;
+	for (int i = 0; i < key.len; i++) {
+		acc ^= (uint8_t) key.str[i];
+		acc *= 16777619u;
+	}
+	return acc;
+}
+
+bool name_comp(Name a, Name b)
+{
+	return a.len == b.len && memcmp(a.str, b.str, a.len) == 0;
+}
+
+int list_length(Lisp_VM * vm, Cell * cell)
+{
+	assert(cell_type(cell) == CELL_CONS);
+	int length = 0;
+	for (; cell != vm->nil; cell = cell->cons.cdr) length++;
+	return length;
+}
+
+Cell * list_index(Lisp_VM * vm, Cell * start, int index)
 {
-	// TODO(pixlark): Better algorithm
-	int acc = 0;
-	while (*key != '\0') acc += *(key++);
-	return acc % table_size;
+	assert(cell_type(start) == CELL_CONS);
+	while (index-- > 0) start = start->cons.cdr;
+	return start;
 }
 
-bool hash_str_comp(char * a, char * b)
+// Returns original if its car and cdr come out unchanged
+Cell * reuse_cons(Lisp_VM * vm, Cell * original, Cell * car, Cell * cdr)
 {
-	return strcmp(a, b) == 0;
+	if (car == original->cons.car && cdr == original->cons.cdr) return original;
+	Cell * cons = alloc_cell(vm, CELL_CONS);
+	cons->cons.car = car;
+	cons->cons.cdr = cdr;
+	return cons;
 }
 
-Cell * cell_push(Lisp_VM * vm, Cell * cell, Cell * to_push)
+void print_cell_as_lisp(Lisp_VM * vm, Cell * cell, bool first_cons)
 {
-	assert(cell->cell_type == CELL_CONS);
 	if (cell == vm->nil) {
-		// If we're trying to push onto NIL, we have to start up a new list
-		Cell * new_cons = alloc_cell();
-		new_cons->cell_type = CELL_CONS;
-		new_cons->cons.car  = to_push;
-		new_cons->cons.cdr  = vm->nil;
-		return new_cons;
-	} else {
-		// If we're not at the end of the list, recurse on CDR
-		cell->cons.cdr = cell_push(vm, cell->cons.cdr, to_push);
-		return cell;
+		fprintf(vm->out, "NIL");
+	} else if (cell_type(cell) == CELL_CONS) {
+		if (first_cons) fprintf(vm->out, "(");
+		while (1) {
+			print_cell_as_lisp(vm, cell->cons.car, true);
+			cell = cell->cons.cdr;
+			if (cell == vm->nil) {
+				fprintf(vm->out, ")");
+				break;
+			}
+			fprintf(vm->out, " ");
+			if (cell_type(cell) != CELL_CONS) {
+				print_cell_as_lisp(vm, cell, false);
+				break;
+			}
+		}
+	} else if (cell_type(cell) == CELL_NUMBER) {
+		fprintf(vm->out, "%d", cell_number(cell));
+	} else if (cell_type(cell) == CELL_SYMBOL) {
+		fprintf(vm->out, "%s", cell->symbol->name);
+	} else if (cell_type(cell) == CELL_LOCAL) {
+		fprintf(vm->out, "%s", cell->local.symbol->name);
+	} else if (cell_type(cell) == CELL_CALL_SITE) {
+		fprintf(vm->out, "%s", cell->call_site.symbol->name);
+	} else if (cell_type(cell) == CELL_LAMBDA) {
+		Cell * code = cell->lambda.code;
+		if (cell_type(code) == CELL_PROCEDURE) code = code->procedure->source;
+		fprintf(vm->out, "(lambda ");
+		print_cell_as_lisp(vm, code, false);
+	} else if (cell_type(cell) == CELL_ENVIRONMENT) {
+		fprintf(vm->out, "<environment>");
+	} else if (cell_type(cell) == CELL_PROCEDURE) {
+		fprintf(vm->out, "<procedure>");
+	} else if (cell_type(cell) == CELL_FUTURE) {
+		fprintf(vm->out, "<future>");
+	} else if (cell_type(cell) == CELL_VECTOR) {
+		fprintf(vm->out, "#(");
+		for (int i = 0; i < cell->vector->length; i++) {
+			fprintf(vm->out, i == 0 ? "%d" : " %d", cell->vector->data[i]);
+		}
+		fprintf(vm->out, ")");
 	}
 }
 
-int list_length(Lisp_VM * vm, Cell * cell)
+Cell * alloc_environment(Lisp_VM * vm, Cell * parent, Cell * params, int count)
 {
-	assert(cell->cell_type == CELL_CONS);
-	if (cell == vm->nil) return 0;
-	else return 1 + list_length(vm, cell->cons.cdr);
+	GC_ROOT(vm, parent);
+	GC_ROOT(vm, params);
+	Cell * env = alloc_cell(vm, CELL_ENVIRONMENT);
+	Environment * frame = (Environment*)
+		malloc(sizeof(Environment) + sizeof(Cell*) * count);
+	frame->parent = parent;
+	frame->params = params;
+	frame->count  = count;
+	frame->captured = false;
+	env->environment = frame;
+	DEBUG_TAG(env, "ENVIRONMENT");
+	return env;
 }
 
-Cell * list_index(Lisp_VM * vm, Cell * start, int index)
+void Lisp_VM::init()
+{
+	// Error handling
+	thrown = false;
+	out    = stdout;
+	// Bytecode interpreter
+	interp      = INTERP_BYTECODE;
+	jit         = false;
+	optimizing     = true;
+	dump_optimized = false;
+	caching        = true;
+	workers        = 0;
+	futures        = NULL;
+	stack       = (Cell**) malloc(sizeof(Cell*) * VM_STACK_SIZE);
+	stack_top   = stack;
+	stack_end   = stack + VM_STACK_SIZE;
+	frame_max   = VM_FRAME_MAX;
+	frames      = (Call_Frame*) malloc(sizeof(Call_Frame) * frame_max);
+	frame_count = 0;
+	// Memory
+	init_heap(this);
+	// Bindings
+	symbols.init(256, name_hash, name_comp);
+	for (int i = 0; i < SPECIAL_FORM_COUNT; i++) {
+		intern(special_forms[i].name)->form = special_forms[i].form;
+	}
+	// NIL and T are allocated old, so they never move
+	gc_inhibit++;
+	nil = alloc_cell(this, CELL_CONS);
+	nil->cons.car = nil;
+	nil->cons.cdr = nil;
+	DEBUG_TAG(nil, "NIL");
+	gc_inhibit--;
+	truth = intern("T")->cell;
+}
+
+void Lisp_VM::dealloc()
+{
+	free_heap(this);
+	free_futures(this);
+	free(stack);
+	free(frames);
+	for (int i = 0; i < symbols.table_size; i++) {
+		if (!symbols.table[i].filled) continue;
+		free(symbols.table[i].value->name);
+		free(symbols.table[i].value);
+	}
+	symbols.dealloc();
+}
+
+/*
+ * PRIMITIVES
+ * Shared by the tree-walker and the bytecode interpreter so that both
+ * agree on semantics and error messages.
+ */
+
+Cell * make_number(Lisp_VM * vm, int number)
 {
-	assert(start->cell_type == CELL_CONS);
-	if (index == 0) return start;
-	else return list_index(vm, start->cons.cdr, index - 1);
+	if (fixnum_fits(number)) return make_fixnum(number);
+	Cell * cell = alloc_cell(vm, CELL_NUMBER);
+	cell->number = number;
+	return cell;
 }
 
-Cell * deep_copy_cell(Lisp_VM * vm, Cell * to_copy)
+Cell * Lisp_VM::arithmetic(char op, Cell * a, Cell * b)
 {
-	if (to_copy == vm->nil)   return vm->nil;
-	if (to_copy == vm->truth) return vm->truth;
-	Cell * copy = alloc_cell();
-	copy->cell_type = to_copy->cell_type;
-	// Could probably do a direct bit-by-bit copy of the union here?
-	switch (to_copy->cell_type) {
+	if (cell_type(a) != CELL_NUMBER || cell_type(b) != CELL_NUMBER) {
+		return throw_error("%c takes numeric arguments.\n", op);
+	}
+	// Wrap on overflow rather than relying on undefined behaviour
+	unsigned x = cell_number(a);
+	unsigned y = cell_number(b);
+	switch (op) {
+	case '+':
+		return make_number(this, (int) (x + y));
+	case '-':
+		return make_number(this, (int) (x - y));
+	case '*':
+		return make_number(this, (int) (x * y));
+	case '/':
+		if (y == 0)        return throw_error("Division by zero.\n");
+		if ((int) y == -1) return make_number(this, (int) (0 - x));
+		return make_number(this, (int) x / (int) y);
+	case '%':
+		if (y == 0)        return throw_error("Division by zero.\n");
+		if ((int) y == -1) return make_number(this, 0);
+		return make_number(this, (int) x % (int) y);
+	}
+	return NULL;
+}
+
+Cell * Lisp_VM::square_root(Cell * a)
+{
+	if (cell_type(a) != CELL_NUMBER) {
+		return throw_error("sqrt takes a numeric argument.\n");
+	}
+	return make_number(this, sqrt(cell_number(a)));
+}
+
+Cell * Lisp_VM::numbers_equal(Cell * a, Cell * b)
+{
+	if (cell_type(a) != CELL_NUMBER || cell_type(b) != CELL_NUMBER) {
+		return throw_error("= takes numeric arguments.\n");
+	}
+	return cell_number(a) == cell_number(b) ? truth : nil;
+}
+
+void Lisp_VM::print_value(Cell * a)
+{
+	switch (cell_type(a)) {
 	case CELL_SYMBOL:
-		copy->symbol = to_copy->symbol;
+		fprintf(out, "%s\n", a->symbol->name);
 		break;
 	case CELL_NUMBER:
-		copy->number = to_copy->number;
+		fprintf(out, "%d\n", cell_number(a));
 		break;
-	case CELL_CONS:
-		copy->cons.car = deep_copy_cell(vm, to_copy->cons.car);
-		copy->cons.cdr = deep_copy_cell(vm, to_copy->cons.cdr);
+	default:
+		print_cell_as_lisp(this, a);
+		fprintf(out, "\n");
 		break;
 	}
-	copy->_debug_tag = "COPY";
-	return copy;
 }
 
-void print_cell_as_lisp(Lisp_VM * vm, Cell * cell, bool first_cons)
+Symbol * Lisp_VM::intern(char * name)
 {
-	if (cell == vm->nil) {
-		printf("NIL");
-	} else if (cell->cell_type == CELL_CONS) {
-		if (first_cons) printf("(");
-		print_cell_as_lisp(vm, cell->cons.car, true);
-		if (cell->cons.cdr == vm->nil) {
-			printf(")");
-		} else {
-			printf(" ");
-			print_cell_as_lisp(vm, cell->cons.cdr, false);
-		}
-	} else if (cell->cell_type == CELL_NUMBER) {
-		printf("%d", cell->number);
-	} else if (cell->cell_type == CELL_SYMBOL) {
-		printf("%s", cell->symbol);
-	}
+	return intern(Name { name, (int) strlen(name) });
 }
 
-Cell * alloc_cell()
+Symbol * Lisp_VM::intern(Name name)
 {
-	Cell * cell = (Cell*) malloc(sizeof(Cell));
-	cell->_debug_tag = "ALLOCATED";
+	Symbol * symbol;
+	if (symbols.index(name, &symbol) == 0) return symbol;
+	symbol = (Symbol*) malloc(sizeof(Symbol));
+	symbol->name = (char*) malloc(name.len + 1);
+	memcpy(symbol->name, name.str, name.len);
+	symbol->name[name.len] = '\0';
+	symbol->hash = name_hash(name);
+	symbol->form = FORM_NONE;
+	symbol->value = NULL;
+	// Symbol cells are immutable and live as long as the VM, so they're allocated old
+	gc_inhibit++;
+	symbol->cell = alloc_cell(this, CELL_SYMBOL);
+	symbol->cell->symbol = symbol;
+	DEBUG_TAG(symbol->cell, symbol->name);
+	gc_inhibit--;
+	symbols.insert(Name { symbol->name, name.len }, symbol);
+	return symbol;
 }
 
-void Lisp_VM::init()
+static Cell * close_over(Lisp_VM * vm, Cell * code, Cell * env)
 {
-	// Error handling
-	thrown = false;
-	// Bindings
-	bindings.init(100, hash_str, hash_str_comp);
-	// NIL
-	nil = alloc_cell();
-	nil->cell_type = CELL_CONS;
-	nil->cons.car  = nil;
-	nil->cons.cdr  = nil;
-	nil->_debug_tag = "NIL";
-	// T
-	truth = alloc_cell();
-	truth->cell_type = CELL_SYMBOL;
-	truth->symbol = "T";
-	truth->_debug_tag = "T";
+	GC_ROOT(vm, code);
+	GC_ROOT(vm, env);
+	// The closure keeps these frames alive, so they can't be reused
+	for (Cell * frame = env; frame != vm->nil; frame = frame->environment->parent) {
+		if (frame->environment->captured) break;
+		frame->environment->captured = true;
+	}
+	Cell * closure = alloc_cell(vm, CELL_LAMBDA);
+	closure->lambda.code = code;
+	closure->lambda.env  = env;
+	DEBUG_TAG(closure, "LAMBDA");
+	return closure;
 }
 
-Cell * Lisp_VM::special_form(Cell * form, Cell * arguments)
+Cell * Lisp_VM::special_form(Cell * form, Cell * arguments, Cell * env)
 {
-	assert(form->cell_type == CELL_SYMBOL);
-	assert(arguments->cell_type == CELL_CONS);
-	char * symbol = form->symbol;
-	if (strcmp(symbol, "set") == 0) {
+	assert(cell_type(form) == CELL_SYMBOL);
+	assert(cell_type(arguments) == CELL_CONS);
+	Symbol * symbol = form->symbol;
+	switch (symbol->form) {
+	case FORM_SET: {
 		if (list_length(this, arguments) != 2) {
 			return throw_error("set takes two arguments.\n");
 		}
-		assert(list_index(this, arguments, 0)->cons.car->cell_type == CELL_SYMBOL);
-		char * bind_symbol = list_index(this, arguments, 0)->cons.car->symbol;
-		Cell * bind_cell   =
-			deep_copy_cell(this, list_index(this, arguments, 1)->cons.car);
-		bindings.insert(bind_symbol, bind_cell);
-		return bind_cell;
-	} else if (strcmp(symbol, "quote") == 0) {
+		if (cell_type(list_index(this, arguments, 0)->cons.car) != CELL_SYMBOL) {
+			return throw_error("set must bind a symbol.\n");
+		}
+		Symbol * bind_symbol = list_index(this, arguments, 0)->cons.car->symbol;
+		Cell * value = evaluate(list_index(this, arguments, 1)->cons.car, env);
+		if (value == NULL) return NULL;
+		// Binding shares the value on purpose, so a vector changed with
+		// vector-set! through one name is changed through every name bound to it
+		bind_symbol->value = value;
+		return value;
+	}
+	case FORM_QUOTE: {
 		if (list_length(this, arguments) != 1) {
 			return throw_error("quote takes one argument.\n");
 		}
 		return list_index(this, arguments, 0)->cons.car;
-	} else if (strcmp(symbol, "if") == 0) {
-		if (list_length(this, arguments) != 3) {
-			return throw_error("if takes three arguments.\n");
-		}
-		Cell * condition = evaluate(list_index(this, arguments, 0)->cons.car);
-		if (condition == NULL) {
-			return NULL;
-		} else if (condition == truth) {
-			Cell * ret = evaluate(list_index(this, arguments, 1)->cons.car);
-			if (ret == NULL) return NULL;
-			return ret;
-		} else if (condition == nil) {
-			Cell * ret = evaluate(list_index(this, arguments, 2)->cons.car);
-			if (ret == NULL) return NULL;
-			return ret;
-		} else {
-			return throw_error("if condition didn't resolve to T or NIL.\n");
-		}
-	} else if (strcmp(symbol, "=") == 0) {
+	}
+	case FORM_EQUAL: {
 		if (list_length(this, arguments) != 2) {
 			return throw_error("= takes two arguments.\n");
 		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
-		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car);
-		if (a == NULL || b == NULL) return NULL;
-		assert(a->cell_type == CELL_NUMBER);
-		assert(b->cell_type == CELL_NUMBER);
-		if (a->number == b->number) {
-			return truth;
-		} else {
-			return nil;
-		}
-	} else if (strcmp(symbol, "progn") == 0) {
-		int arg_count = list_length(this, arguments);
-		Cell * ret;
-		for (int i = 0; i < arg_count; i++) {
-			Cell * arg = list_index(this, arguments, i)->cons.car;
-			ret = evaluate(arg);
-			if (ret == NULL) return NULL;
-		}
-		return ret;
-	} else if (strcmp(symbol, "+") == 0) {
-		if (list_length(this, arguments) != 2) {
-			return throw_error("+ takes two arguments.\n");
-		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
-		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car);
-		if (a == NULL || b == NULL) return NULL;
-		assert(a->cell_type == CELL_NUMBER);
-		assert(b->cell_type == CELL_NUMBER);
-		Cell * ret = alloc_cell();
-		ret->cell_type = CELL_NUMBER;
-		ret->number = a->number + b->number;
-		return ret;
-	} else if (strcmp(symbol, "-") == 0) {
-		if (list_length(this, arguments) != 2) {
-			return throw_error("+ takes two arguments.\n");
-		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
-		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car);
-		if (a == NULL || b == NULL) return NULL;
-		assert(a->cell_type == CELL_NUMBER);
-		assert(b->cell_type == CELL_NUMBER);
-		Cell * ret = alloc_cell();
-		ret->cell_type = CELL_NUMBER;
-		ret->number = a->number - b->number;
-		return ret;
-	} else if (strcmp(symbol, "*") == 0) {
-		if (list_length(this, arguments) != 2) {
-			return throw_error("* takes two arguments.\n");
-		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
-		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car);
-		if (a == NULL || b == NULL) return NULL;
-		assert(a->cell_type == CELL_NUMBER);
-		assert(b->cell_type == CELL_NUMBER);
-		Cell * ret = alloc_cell();
-		ret->cell_type = CELL_NUMBER;
-		ret->number = a->number * b->number;
-		return ret;
-	} else if (strcmp(symbol, "/") == 0) {
+		GC_ROOT(this, env);
+		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car, env);
+		if (a == NULL) return NULL;
+		GC_ROOT(this, a);
+		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car, env);
+		if (b == NULL) return NULL;
+		return numbers_equal(a, b);
+	}
+	case FORM_LAMBDA: {
 		if (list_length(this, arguments) != 2) {
-			return throw_error("/ takes two arguments.\n");
-		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
-		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car);
-		if (a == NULL || b == NULL) return NULL;
-		assert(a->cell_type == CELL_NUMBER);
-		assert(b->cell_type == CELL_NUMBER);
-		Cell * ret = alloc_cell();
-		ret->cell_type = CELL_NUMBER;
-		ret->number = a->number / b->number;
-		return ret;
-	} else if (strcmp(symbol, "%") == 0 || strcmp(symbol, "mod") == 0) {
+			return throw_error("lambda takes two arguments.\n");
+		}
+		Cell * params = list_index(this, arguments, 0)->cons.car;
+		if (cell_type(params) != CELL_CONS) {
+			return throw_error("lambda parameters must be a list.\n");
+		}
+		for (Cell * param = params; param != nil; param = param->cons.cdr) {
+			if (cell_type(param->cons.car) != CELL_SYMBOL) {
+				return throw_error("lambda parameters must be symbols.\n");
+			}
+		}
+		return close_over(this, arguments, env);
+	}
+	case FORM_ADD:
+	case FORM_SUB:
+	case FORM_MUL:
+	case FORM_DIV:
+	case FORM_MOD: {
 		if (list_length(this, arguments) != 2) {
-			return throw_error("%/mod takes two arguments.\n");
-		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
-		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car);
-		if (a == NULL || b == NULL) return NULL;
-		assert(a->cell_type == CELL_NUMBER);
-		assert(b->cell_type == CELL_NUMBER);
-		Cell * ret = alloc_cell();
-		ret->cell_type = CELL_NUMBER;
-		ret->number = a->number % b->number;
-		return ret;
-	} else if (strcmp(symbol, "sqrt") == 0) {
+			return throw_error("%s takes two arguments.\n", symbol->name);
+		}
+		GC_ROOT(this, env);
+		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car, env);
+		if (a == NULL) return NULL;
+		GC_ROOT(this, a);
+		Cell * b = evaluate(list_index(this, arguments, 1)->cons.car, env);
+		if (b == NULL) return NULL;
+		return arithmetic("+-*/%"[symbol->form - FORM_ADD], a, b);
+	}
+	case FORM_GC: {
+		if (list_length(this, arguments) != 0) {
+			return throw_error("gc takes no arguments.\n");
+		}
+		return make_number(this, collect());
+	}
+	case FORM_SQRT: {
 		if (list_length(this, arguments) != 1) {
-			return throw_error("sqrt takes two arguments.\n");
+			return throw_error("sqrt takes one argument.\n");
 		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
+		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car, env);
 		if (a == NULL) return NULL;
-		assert(a->cell_type == CELL_NUMBER);
-		Cell * ret = alloc_cell();
-		ret->cell_type = CELL_NUMBER;
-		ret->number = sqrt(a->number);
-		return ret;
-	} else if (strcmp(symbol, "print") == 0) {
+		return square_root(a);
+	}
+	case FORM_PRINT: {
 		if (list_length(this, arguments) != 1) {
 			return throw_error("print takes one argument.\n");
 		}
-		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car);
+		Cell * a = evaluate(list_index(this, arguments, 0)->cons.car, env);
 		if (a == NULL) return NULL;
-		switch (a->cell_type) {
-		case CELL_SYMBOL:
-			printf("%s\n", a->symbol);
-			break;
-		case CELL_NUMBER:
-			printf("%d\n", a->number);
-			break;
-		case CELL_CONS:
-			print_cell_as_lisp(this, a);
-			printf("\n");
-			break;
-		}
+		print_value(a);
 		return a;
 	}
-	return NULL;
+	case FORM_MAKE_VECTOR:
+	case FORM_VECTOR_REF:
+	case FORM_VECTOR_SET:
+	case FORM_LENGTH:
+	case FORM_VSUM:
+	case FORM_VDOT:
+	case FORM_VADD:
+	case FORM_VSCALE:
+	case FORM_VMIN:
+	case FORM_VMAX: {
+		int arity = vector_form_arity(symbol->form);
+		if (list_length(this, arguments) != arity) {
+			return throw_error("%s takes %s.\n", symbol->name, arity_text(arity));
+		}
+		GC_ROOT(this, env);
+		Cell * args[3] = { nil, nil, nil };
+		for (int i = 0; i < 3; i++) push_root(&args[i]);
+		defer { pop_roots(3); };
+		Cell * arg = arguments;
+		for (int i = 0; i < arity; i++) {
+			args[i] = evaluate(arg->cons.car, env);
+			if (args[i] == NULL) return NULL;
+			arg = arg->cons.cdr;
+		}
+		return vector_builtin(symbol->form, args);
+	}
+	case FORM_FUTURE: {
+		if (list_length(this, arguments) != 1) {
+			return throw_error("future takes one argument.\n");
+		}
+		// Run as (lambda () expr), which the resolver has already put expr one frame inside of
+		GC_ROOT(this, env);
+		Cell * code = alloc_cell(this, CELL_CONS);
+		code->cons.car = nil;
+		code->cons.cdr = arguments;
+		Cell * thunk = close_over(this, code, env);
+		GC_ROOT(this, thunk);
+		return parallel_builtin(FORM_FUTURE, &thunk);
+	}
+	case FORM_PMAP:
+	case FORM_PREDUCE:
+	case FORM_TOUCH: {
+		int arity = parallel_form_arity(symbol->form);
+		if (list_length(this, arguments) != arity) {
+			return throw_error("%s takes %s.\n", symbol->name, arity_text(arity));
+		}
+		GC_ROOT(this, env);
+		Cell * args[3] = { nil, nil, nil };
+		for (int i = 0; i < 3; i++) push_root(&args[i]);
+		defer { pop_roots(3); };
+		Cell * arg = arguments;
+		for (int i = 0; i < arity; i++) {
+			args[i] = evaluate(arg->cons.car, env);
+			if (args[i] == NULL) return NULL;
+			arg = arg->cons.cdr;
+		}
+		return parallel_builtin(symbol->form, args);
+	}
+	default:
+		// if and progn are handled by evaluate, in tail position
+		return NULL;
+	}
 }
 
-void Lisp_VM::substitute_arguments(Cell * procedure, char * param, Cell * arg)
+// Symbols are global references once resolved
+static inline bool is_reference(Cell * cell)
 {
-	assert(procedure->cell_type == CELL_CONS);
-	switch (procedure->cons.car->cell_type) {
-	case CELL_CONS:
-		substitute_arguments(procedure->cons.car, param, arg);
-		break;
-	case CELL_SYMBOL:
-		if (strcmp(procedure->cons.car->symbol, param) == 0) {
-			procedure->cons.car = deep_copy_cell(this, arg);
+	Cell_Type type = cell_type(cell);
+	return type == CELL_SYMBOL || type == CELL_LOCAL || type == CELL_CALL_SITE;
+}
+
+Cell * Lisp_VM::lookup(Cell * reference, Cell * env)
+{
+	// The resolver has turned every parameter reference into a slot, so any symbol left is global
+	if (cell_type(reference) == CELL_LOCAL) {
+		for (int depth = reference->local.depth; depth > 0; depth--) {
+			env = env->environment->parent;
 		}
-		break;
-	default:
-		break;
+		return env->environment->values[reference->local.index];
 	}
-	if (procedure->cons.cdr != nil) {
-		substitute_arguments(procedure->cons.cdr, param, arg);
+	Symbol * symbol = reference->symbol;
+	if (cell_type(reference) == CELL_CALL_SITE) symbol = reference->call_site.symbol;
+	if (symbol->value == NULL) {
+		return throw_error("Symbol %s not bound.\n", symbol->name);
 	}
+	return symbol->value;
 }
 
-Cell * Lisp_VM::apply_function(Cell * to_call, Cell * arguments)
+Cell * Lisp_VM::bind_arguments(Cell * to_call, Cell * arguments, Cell * env, Cell * reusable, bool checked)
 {
-	/* 1. Copy procedure tree
-	 * 2. Substitute arguments in procedure tree
-	 * 3. Substitute function with their recursively
-     *    applied bodies
-	 * 4. Evaluate
+	/* Evaluates the arguments in the caller's environment and binds
+	 * them in a frame whose parent is the closure's captured
+	 * environment. If reusable is a frame of the same size that no
+	 * closure has captured, it is overwritten instead of allocating.
+	 * A checked call comes from a call site that has already called
+	 * to_call successfully, so it can't be the wrong type or arity.
 	 */
-	assert(to_call->cell_type == CELL_CONS);
-	assert(to_call->cons.car->cell_type == CELL_SYMBOL);
-	assert(strcmp(to_call->cons.car->symbol, "lambda") == 0);
-	
-	Cell * lambda = deep_copy_cell(this, to_call);
-	Cell * procedure = lambda->cons.cdr->cons.cdr->cons.car;
+	if (!checked && cell_type(to_call) != CELL_LAMBDA) {
+		return throw_error("Attempted to call something that isn't a function.\n");
+	}
 	
-	Cell * params = lambda->cons.cdr->cons.car;
+	GC_ROOT(this, to_call);
+	GC_ROOT(this, env);
+	GC_ROOT(this, reusable);
+	Cell * params = to_call->lambda.code->cons.car;
 	Cell * args   = arguments;
 
-	assert(list_length(this, params) == list_length(this, args));
-	for (int i = 0; i < list_length(this, params); i++) {
-		Cell * param_cons = list_index(this, params, i);
-		assert(param_cons->cell_type == CELL_CONS);
-		assert(param_cons->cons.car->cell_type == CELL_SYMBOL);
-		char * param = param_cons->cons.car->symbol;
-		
-		Cell * arg_cons = list_index(this, args, i);
-		assert(arg_cons->cell_type == CELL_CONS);
-
-		Cell * eval_arg = evaluate(arg_cons->cons.car);
+	int param_count = list_length(this, params);
+	if (!checked && param_count != list_length(this, args)) {
+		return throw_error("Function takes %d arguments.\n", param_count);
+	}
+	if (reusable != NULL && param_count <= FRAME_REUSE_MAX) {
+		Cell * values[FRAME_REUSE_MAX];
+		for (int i = 0; i < param_count; i++) values[i] = nil;
+		for (int i = 0; i < param_count; i++) push_root(&values[i]);
+		defer { pop_roots(param_count); };
+		Cell * arg = args;
+		for (int i = 0; i < param_count; i++) {
+			values[i] = evaluate(arg->cons.car, env);
+			if (values[i] == NULL) return NULL;
+			arg = arg->cons.cdr;
+		}
+		// Evaluating the arguments may have captured the frame
+		Environment * frame = reusable->environment;
+		Cell * target = reusable;
+		if (frame->captured || frame->count != param_count) {
+			target = alloc_environment(this, to_call->lambda.env, params, param_count);
+			frame  = target->environment;
+		}
+		frame->parent = to_call->lambda.env;
+		frame->params = params;
+		write_barrier(this, target, frame->parent);
+		for (int i = 0; i < param_count; i++) {
+			frame->values[i] = values[i];
+			write_barrier(this, target, values[i]);
+		}
+		return target;
+	}
+	Cell * frame = alloc_environment(this, to_call->lambda.env, params, param_count);
+	for (int i = 0; i < param_count; i++) frame->environment->values[i] = nil;
+	GC_ROOT(this, frame);
+	Cell * arg = args;
+	for (int i = 0; i < param_count; i++) {
+		assert(cell_type(arg) == CELL_CONS);
+		Cell * eval_arg = evaluate(arg->cons.car, env);
+		arg = arg->cons.cdr;
 		if (eval_arg == NULL) return NULL;
-		Cell * arg = deep_copy_cell(this, eval_arg);
+		frame->environment->values[i] = eval_arg;
+		// Evaluating the arguments may have promoted the frame
+		write_barrier(this, frame, eval_arg);
+	}
+	return frame;
+}
 
-		substitute_arguments(procedure, param, arg);
+/*
+ * RESOLVER
+ * Rewrites a form for the tree-walker before it runs. Each parameter
+ * reference becomes a CELL_LOCAL naming its frame and slot, so looking
+ * it up is a walk up the frame chain and an index, not a search by
+ * name. Parsed forms are shared, so anything resolved is rebuilt
+ * rather than changed in place, and anything left untouched is reused.
+ */
+
+struct Resolve_Scope {
+	Cell *          params;
+	Resolve_Scope * parent;
+};
+
+static Cell * resolve(Lisp_VM * vm, Cell * form, Resolve_Scope * scope);
+
+static Cell * resolve_list(Lisp_VM * vm, Cell * list, Resolve_Scope * scope)
+{
+	List<Cell*> spine;
+	List<Cell*> items;
+	spine.alloc();
+	items.alloc();
+	defer { spine.dealloc(); items.dealloc(); };
+	Cell * tail = list;
+	for (; tail != vm->nil && cell_type(tail) == CELL_CONS; tail = tail->cons.cdr) {
+		spine.push(tail);
+		items.push(resolve(vm, tail->cons.car, scope));
 	}
-	
-	Cell * resolved = evaluate(procedure);
-	if (resolved == NULL) return NULL;
-	
-	return resolved;
+	for (int i = spine.len - 1; i >= 0; i--) {
+		tail = reuse_cons(vm, spine[i], items[i], tail);
+	}
+	return tail;
+}
+
+static Cell * resolve(Lisp_VM * vm, Cell * form, Resolve_Scope * scope)
+{
+	if (cell_type(form) == CELL_SYMBOL) {
+		int depth = 0;
+		for (Resolve_Scope * s = scope; s != NULL; s = s->parent, depth++) {
+			int index = 0;
+			for (Cell * param = s->params; param != vm->nil; param = param->cons.cdr, index++) {
+				if (param->cons.car != form) continue;
+				Cell * local = alloc_cell(vm, CELL_LOCAL);
+				local->local.symbol = form->symbol;
+				local->local.depth  = depth;
+				local->local.index  = index;
+				DEBUG_TAG(local, "LOCAL");
+				return local;
+			}
+		}
+		return form;
+	}
+	if (cell_type(form) != CELL_CONS || form == vm->nil) return form;
+
+	Cell * head = form->cons.car;
+	Special_Form special = FORM_NONE;
+	if (cell_type(head) == CELL_SYMBOL) special = head->symbol->form;
+	Cell * arguments = form->cons.cdr;
+	switch (special) {
+	case FORM_NONE: {
+		Cell * callee = resolve(vm, head, scope);
+		if (callee == head && cell_type(head) == CELL_SYMBOL) {
+			// Globals being called get a cache of what they were bound to
+			callee = alloc_cell(vm, CELL_CALL_SITE);
+			callee->call_site.symbol = head->symbol;
+			callee->call_site.callee = NULL;
+			DEBUG_TAG(callee, "CALL SITE");
+		}
+		return reuse_cons(vm, form, callee, resolve_list(vm, arguments, scope));
+	}
+	case FORM_QUOTE:
+		return form;
+	case FORM_SET: {
+		// The symbol being bound is always global
+		if (arguments == vm->nil) return form;
+		Cell * rest = resolve_list(vm, arguments->cons.cdr, scope);
+		return reuse_cons(vm, form, head, reuse_cons(vm, arguments, arguments->cons.car, rest));
+	}
+	case FORM_LAMBDA: {
+		// Malformed lambdas are left for special_form to report
+		if (list_length(vm, arguments) != 2) return form;
+		Cell * params = arguments->cons.car;
+		if (cell_type(params) != CELL_CONS) return form;
+		for (Cell * param = params; param != vm->nil; param = param->cons.cdr) {
+			if (cell_type(param->cons.car) != CELL_SYMBOL) return form;
+		}
+		Resolve_Scope inner = { params, scope };
+		Cell * body = resolve_list(vm, arguments->cons.cdr, &inner);
+		return reuse_cons(vm, form, head, reuse_cons(vm, arguments, params, body));
+	}
+	case FORM_FUTURE: {
+		// The expression runs as the body of (lambda () expr)
+		Resolve_Scope inner = { vm->nil, scope };
+		return reuse_cons(vm, form, head, resolve_list(vm, arguments, &inner));
+	}
+	default:
+		return reuse_cons(vm, form, head, resolve_list(vm, arguments, scope));
+	}
+}
+
+Cell * Lisp_VM::evaluate(Cell * form)
+{
+	if (optimizing) {
+		gc_inhibit++;
+		Cell * optimized = optimize(this, form);
+		gc_inhibit--;
+		if (dump_optimized && optimized != form) {
+			fprintf(out, "; ");
+			print_cell_as_lisp(this, form);
+			fprintf(out, "\n; => ");
+			print_cell_as_lisp(this, optimized);
+			fprintf(out, "\n");
+		}
+		form = optimized;
+	}
+	if (interp == INTERP_TREE) {
+		gc_inhibit++;
+		Cell * resolved = resolve(this, form, NULL);
+		gc_inhibit--;
+		GC_ROOT(this, resolved);
+		return evaluate(resolved, nil);
+	}
+	Cell * procedure = compile(this, form);
+	if (procedure == NULL) return NULL;
+	return execute(procedure);
+}
+
+Cell * Lisp_VM::apply(Cell * function, Cell * arguments)
+{
+	// Called as ((quote function) (quote argument)...), so nothing is evaluated twice
+	Cell * form = nil;
+	GC_ROOT(this, form);
+	gc_inhibit++;
+	Cell * quote = intern("quote")->cell;
+	Cell ** tail = &form;
+	auto push_quoted = [&](Cell * value) {
+		Cell * quoted = alloc_cell(this, CELL_CONS);
+		quoted->cons.car = value;
+		quoted->cons.cdr = nil;
+		// Collection is inhibited, so quoted is old while value may be young
+		write_barrier(this, quoted, value);
+		Cell * call = alloc_cell(this, CELL_CONS);
+		call->cons.car = quote;
+		call->cons.cdr = quoted;
+		Cell * cons = alloc_cell(this, CELL_CONS);
+		cons->cons.car = call;
+		cons->cons.cdr = nil;
+		*tail = cons;
+		tail = &cons->cons.cdr;
+	};
+	push_quoted(function);
+	for (Cell * arg = arguments; arg != nil; arg = arg->cons.cdr) push_quoted(arg->cons.car);
+	gc_inhibit--;
+	if (interp == INTERP_TREE) return evaluate(form, nil);
+	Cell * procedure = compile(this, form);
+	if (procedure == NULL) return NULL;
+	return execute(procedure);
 }
 
-Cell * Lisp_VM::evaluate(Cell * cell)
+Cell * Lisp_VM::evaluate(Cell * cell, Cell * env)
 {
-	if (cell->cell_type == CELL_NUMBER) {
-		return cell;
-	} else if (cell->cell_type == CELL_SYMBOL) {
-		if (bindings.index(cell->symbol, NULL)) {
-			printf("Symbol %s not bound.\n", cell->symbol);
-			return NULL;
-		}
-		Cell * resolved;
-		bindings.index(cell->symbol, &resolved);
-		return resolved;
-	} else if (cell->cell_type == CELL_CONS) {
+	/* Expressions in tail position (the branches of if, the last form
+	 * of progn and the body of a called lambda) are evaluated by going
+	 * around the loop instead of recursing, so tail calls run in
+	 * constant native stack. Frames created by this loop are handed
+	 * back to bind_arguments so the next tail call can reuse them.
+	 */
+	// Leaves don't allocate, so they skip the rooting below
+	if (is_reference(cell))           return lookup(cell, env);
+	if (cell_type(cell) != CELL_CONS) return cell;
+	Cell * own_frame = NULL;
+	Cell * to_call   = NULL;
+	GC_ROOT(this, cell);
+	GC_ROOT(this, env);
+	GC_ROOT(this, own_frame);
+	GC_ROOT(this, to_call);
+	while (1) {
+		if (is_reference(cell)) {
+			return lookup(cell, env);
+		} else if (cell_type(cell) != CELL_CONS) {
+			// Numbers and closures evaluate to themselves
+			return cell;
+		}
 		if (cell == nil) return nil;
+		Cell * head      = cell->cons.car;
+		Cell * arguments = cell->cons.cdr;
 		// Check for special forms
-		if (cell->cons.car->cell_type == CELL_SYMBOL) {
-			if (string_in_list(
-					special_forms,
-					SPECIAL_FORM_COUNT,
-					cell->cons.car->symbol)) {
-				return special_form(cell->cons.car, cell->cons.cdr);
+		Special_Form form = FORM_NONE;
+		if (cell_type(head) == CELL_SYMBOL) form = head->symbol->form;
+		if (form != FORM_NONE) {
+			if (form == FORM_IF) {
+				if (list_length(this, arguments) != 3) {
+					return throw_error("if takes three arguments.\n");
+				}
+				Cell * condition = evaluate(list_index(this, arguments, 0)->cons.car, env);
+				if (condition == NULL) {
+					return NULL;
+				} else if (condition == truth) {
+					cell = list_index(this, arguments, 1)->cons.car;
+				} else if (condition == nil) {
+					cell = list_index(this, arguments, 2)->cons.car;
+				} else {
+					return throw_error("if condition didn't resolve to T or NIL.\n");
+				}
+				continue;
+			} else if (form == FORM_PROGN) {
+				if (arguments == nil) return nil;
+				Cell * arg = arguments;
+				for (; arg->cons.cdr != nil; arg = arg->cons.cdr) {
+					if (evaluate(arg->cons.car, env) == NULL) return NULL;
+				}
+				cell = arg->cons.car;
+				continue;
+			} else {
+				return special_form(head, arguments, env);
 			}
 		}
-		// Evaluate head and apply to body
-		Cell * head = evaluate(cell->cons.car);
-		if (head == NULL) return NULL;
-		return apply_function(head, cell->cons.cdr);
+		// Evaluate head and apply to body, unless the call site's cache is still good
+		bool cached = false;
+		if (cell_type(head) == CELL_CALL_SITE) {
+			to_call = head->call_site.symbol->value;
+			cached  = to_call != NULL && to_call == head->call_site.callee;
+		}
+		if (!cached) {
+			to_call = evaluate(head, env);
+			if (to_call == NULL) return NULL;
+		}
+		Cell * frame = bind_arguments(to_call, arguments, env, own_frame, cached);
+		if (frame == NULL) return NULL;
+		/* Call sites are old, so caching only old callees keeps them out
+		 * of the remembered set. A global that's called often is old by
+		 * the time it misses again anyway.
+		 */
+		head = cell->cons.car;
+		if (!cached && cell_type(head) == CELL_CALL_SITE && !is_young(to_call)) {
+			head->call_site.callee = to_call;
+		}
+		own_frame = frame;
+		env       = frame;
+		cell      = to_call->lambda.code->cons.cdr->cons.car;
 	}
-	return NULL;
 }
 
 Cell * Lisp_VM::throw_error(char * format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	
-	char buffer [1024];
-	vsprintf(buffer, format, args);
-	err_str = (char*) malloc(strlen(buffer) + 1);
-	strcpy(err_str, buffer);
-	
+	vsnprintf(error, sizeof(error), format, args);
 	va_end(args);
 
 	thrown = true;
@@ -416,11 +823,38 @@ Cell * Lisp_VM::throw_error(char * format, ...)
 void Lisp_VM::display_error()
 {
 	if (!thrown) return;
-	printf("%s\n", err_str);
-	free(err_str);
+	fprintf(out, "%s\n", error);
 	thrown = false;
 }
 
+// Prints what form evaluates to, or the error it threw
+static void run_form(Lisp_VM * vm, Cell * form)
+{
+	Cell * evaluated = vm->evaluate(form);
+	if (evaluated != NULL) {
+		print_cell_as_lisp(vm, evaluated);
+		fprintf(vm->out, "\n");
+	} else {
+		vm->display_error();
+		fprintf(vm->out, "Error encountered. Continuing from REPL...\n");
+	}
+}
+
+// Evaluates each form the reader produces, printing the results
+static void run(Lisp_VM * vm, Reader * reader, bool interactive)
+{
+	while (1) {
+		Cell * form = reader->read();
+		if (form == NULL) return;
+		GC_ROOT(vm, form);
+		if (interactive && cell_type(form) == CELL_CONS && form->cons.car == vm->intern("quit")->cell &&
+			form->cons.cdr == vm->nil) {
+			return;
+		}
+		run_form(vm, form);
+	}
+}
+
 int main(int argc, char ** argv)
 {
 	Lisp_VM __vm;
@@ -429,35 +863,77 @@ int main(int argc, char ** argv)
 
 	List<char*> start_inputs;
 	start_inputs.alloc();
+	char * image_to_load = NULL;
+	char * image_to_save = NULL;
 	
 	if (argc > 1) {
 		for (int i = 1; i < argc; i++) {
-			start_inputs.push(load_string_from_file(argv[i]));
+			if (strcmp(argv[i], "--interp=tree") == 0) {
+				vm->interp = INTERP_TREE;
+			} else if (strcmp(argv[i], "--interp=bytecode") == 0) {
+				vm->interp = INTERP_BYTECODE;
+			} else if (strcmp(argv[i], "--jit") == 0) {
+				vm->jit = true;
+			} else if (strcmp(argv[i], "--no-opt") == 0) {
+				vm->optimizing = false;
+			} else if (strcmp(argv[i], "--dump-opt") == 0) {
+				vm->dump_optimized = true;
+			} else if (strcmp(argv[i], "--no-cache") == 0) {
+				vm->caching = false;
+			} else if (strncmp(argv[i], "--workers=", 10) == 0) {
+				vm->workers = atoi(argv[i] + 10);
+			} else if (strcmp(argv[i], "--load-image") == 0 && i + 1 < argc) {
+				image_to_load = argv[++i];
+			} else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) {
+				image_to_save = argv[++i];
+			} else {
+				start_inputs.push(argv[i]);
+			}
 		}
 	}
 	
-	while (1) {
-		char * source;
-		if (start_inputs.len > 0) {
-			source = start_inputs.pop();
-		} else {
-			printf("$ ");
-			char source_buffer[512];
-			fgets(source_buffer, 512, stdin);
-			if (strcmp(source_buffer, "(quit)\n") == 0) break;
-			source = source_buffer;
-		}
-		Cell * parsed = parse_source(vm, source);
-		while (parsed != vm->nil) {
-			Cell * evaluated = vm->evaluate(parsed->cons.car);
-			if (evaluated != NULL) {
-				print_cell_as_lisp(vm, evaluated);
-				printf("\n");
-			} else {
-				vm->display_error();
-				printf("Error encountered. Continuing from REPL...\n");
+	if (image_to_load != NULL && !load_image(vm, image_to_load)) {
+		vm->display_error();
+		return 1;
+	}
+
+	// Later files are parsed while earlier ones run, but they run in the order given
+	Loader * loader = start_loading(vm, start_inputs.arr, start_inputs.len);
+	for (int i = 0; i < start_inputs.len; i++) {
+		if (loader == NULL) {
+			Reader reader;
+			if (!reader.open(vm, start_inputs[i])) {
+				fprintf(vm->out, "Couldn't open %s\n", start_inputs[i]);
+				continue;
 			}
-			parsed = parsed->cons.cdr;
+			run(vm, &reader, false);
+			reader.dealloc();
+			continue;
 		}
+		Cell * forms = take_loaded(loader, i);
+		if (forms == NULL) {
+			fprintf(vm->out, "Couldn't open %s\n", start_inputs[i]);
+			continue;
+		}
+		GC_ROOT(vm, forms);
+		for (; forms != vm->nil; forms = forms->cons.cdr) run_form(vm, forms->cons.car);
 	}
+	if (loader != NULL) stop_loading(loader);
+
+	// Saving an image is a build step, so it takes the place of the REPL
+	if (image_to_save != NULL) {
+		if (!save_image(vm, image_to_save)) {
+			vm->display_error();
+			return 1;
+		}
+		return 0;
+	}
+
+	Reader repl;
+	repl.init(vm, stdin, "$ ");
+	run(vm, &repl, true);
+	repl.dealloc();
+	start_inputs.dealloc();
+	vm->dealloc();
+	return 0;
 }
@@ -0,0 +1,160 @@
+#include "vm.h"
+
+/*
+ * OPTIMIZER
+ * Rewrites a top-level form before either interpreter sees it. Special
+ * forms can't be shadowed, so builtins applied to literals always mean
+ * the same thing and can be evaluated here once. Anything malformed is
+ * left alone, so it fails at run time with the usual error.
+ */
+
+static Special_Form form_of(Cell * cell)
+{
+	return cell_type(cell) == CELL_SYMBOL ? cell->symbol->form : FORM_NONE;
+}
+
+static bool is_form(Lisp_VM * vm, Cell * cell, Special_Form form)
+{
+	return cell_type(cell) == CELL_CONS && cell != vm->nil && form_of(cell->cons.car) == form;
+}
+
+static bool is_literal_number(Cell * cell)
+{
+	return cell_type(cell) == CELL_NUMBER;
+}
+
+// T isn't bound, so the folded form of a true comparison is (quote T)
+static Cell * quoted_truth(Lisp_VM * vm)
+{
+	Cell * quoted = alloc_cell(vm, CELL_CONS);
+	quoted->cons.car = vm->truth;
+	quoted->cons.cdr = vm->nil;
+	Cell * form = alloc_cell(vm, CELL_CONS);
+	form->cons.car = vm->intern("quote")->cell;
+	form->cons.cdr = quoted;
+	return form;
+}
+
+static bool is_quoted_truth(Lisp_VM * vm, Cell * cell)
+{
+	return is_form(vm, cell, FORM_QUOTE) && list_length(vm, cell->cons.cdr) == 1 &&
+		cell->cons.cdr->cons.car == vm->truth;
+}
+
+static Cell * optimize_list(Lisp_VM * vm, Cell * list)
+{
+	List<Cell*> spine;
+	List<Cell*> items;
+	spine.alloc();
+	items.alloc();
+	defer { spine.dealloc(); items.dealloc(); };
+	Cell * tail = list;
+	for (; tail != vm->nil && cell_type(tail) == CELL_CONS; tail = tail->cons.cdr) {
+		spine.push(tail);
+		items.push(optimize(vm, tail->cons.car));
+	}
+	for (int i = spine.len - 1; i >= 0; i--) {
+		tail = reuse_cons(vm, spine[i], items[i], tail);
+	}
+	return tail;
+}
+
+// Splices the bodies of nested progns into this one
+static Cell * flatten_progn(Lisp_VM * vm, Cell * form)
+{
+	List<Cell*> items;
+	items.alloc();
+	defer { items.dealloc(); };
+	bool nested = false;
+	for (Cell * arg = form->cons.cdr; arg != vm->nil; arg = arg->cons.cdr) {
+		Cell * item = arg->cons.car;
+		if (is_form(vm, item, FORM_PROGN) && item->cons.cdr != vm->nil) {
+			nested = true;
+			for (Cell * inner = item->cons.cdr; inner != vm->nil; inner = inner->cons.cdr) {
+				items.push(inner->cons.car);
+			}
+		} else {
+			items.push(item);
+		}
+	}
+	if (items.len == 1) return items[0];
+	if (!nested) return form;
+	Cell * body = vm->nil;
+	for (int i = items.len - 1; i >= 0; i--) {
+		Cell * cons = alloc_cell(vm, CELL_CONS);
+		cons->cons.car = items[i];
+		cons->cons.cdr = body;
+		body = cons;
+	}
+	return reuse_cons(vm, form, form->cons.car, body);
+}
+
+Cell * optimize(Lisp_VM * vm, Cell * form)
+{
+	if (cell_type(form) != CELL_CONS || form == vm->nil) return form;
+	Cell * head = form->cons.car;
+	Cell * arguments = form->cons.cdr;
+	Special_Form special = form_of(head);
+
+	switch (special) {
+	case FORM_QUOTE: {
+		// Numbers and NIL evaluate to themselves, so quoting them does nothing
+		if (list_length(vm, arguments) != 1) return form;
+		Cell * quoted = arguments->cons.car;
+		if (is_literal_number(quoted) || quoted == vm->nil) return quoted;
+		return form;
+	}
+	case FORM_LAMBDA:
+		if (list_length(vm, arguments) != 2) return form;
+		return reuse_cons(vm, form, head, reuse_cons(vm, arguments,
+			arguments->cons.car, optimize_list(vm, arguments->cons.cdr)));
+	case FORM_SET:
+		if (arguments == vm->nil) return form;
+		return reuse_cons(vm, form, head, reuse_cons(vm, arguments,
+			arguments->cons.car, optimize_list(vm, arguments->cons.cdr)));
+	default:
+		break;
+	}
+
+	form = reuse_cons(vm, form, optimize(vm, head), optimize_list(vm, arguments));
+	arguments = form->cons.cdr;
+	int count = list_length(vm, arguments);
+	switch (special) {
+	case FORM_ADD:
+	case FORM_SUB:
+	case FORM_MUL:
+	case FORM_DIV:
+	case FORM_MOD: {
+		if (count != 2) return form;
+		Cell * a = list_index(vm, arguments, 0)->cons.car;
+		Cell * b = list_index(vm, arguments, 1)->cons.car;
+		if (!is_literal_number(a) || !is_literal_number(b)) return form;
+		// Division by zero is left to raise its error when it runs
+		if ((special == FORM_DIV || special == FORM_MOD) && cell_number(b) == 0) return form;
+		return vm->arithmetic("+-*/%"[special - FORM_ADD], a, b);
+	}
+	case FORM_SQRT: {
+		if (count != 1 || !is_literal_number(arguments->cons.car)) return form;
+		return vm->square_root(arguments->cons.car);
+	}
+	case FORM_EQUAL: {
+		if (count != 2) return form;
+		Cell * a = list_index(vm, arguments, 0)->cons.car;
+		Cell * b = list_index(vm, arguments, 1)->cons.car;
+		if (!is_literal_number(a) || !is_literal_number(b)) return form;
+		return vm->numbers_equal(a, b) == vm->truth ? quoted_truth(vm) : vm->nil;
+	}
+	case FORM_IF: {
+		if (count != 3) return form;
+		Cell * condition = arguments->cons.car;
+		if (condition == vm->nil)             return list_index(vm, arguments, 2)->cons.car;
+		if (is_quoted_truth(vm, condition)) return list_index(vm, arguments, 1)->cons.car;
+		return form;
+	}
+	case FORM_PROGN:
+		if (count == 0) return form;
+		return flatten_progn(vm, form);
+	default:
+		return form;
+	}
+}
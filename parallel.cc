@@ -0,0 +1,802 @@
+// Before ds_util.h, whose defer macro would clash with pthread.h
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "bytecode.h"
+#include "lex-parse.h"
+
+/*
+ * PARALLEL MAP AND REDUCE
+ * (pmap f list) and (preduce f init list) hand the list out to worker
+ * threads. Each worker runs its own VM, so nothing is shared while
+ * they run: f and each item are copied into the worker's heap, along
+ * with every global they refer to, and the results are copied back
+ * once every worker is done. The calling VM only waits meanwhile, so
+ * its heap holds still for the workers to copy from.
+ *
+ * That means f should be pure. Globals it sets, or cells it changes,
+ * belong to the worker and are gone once pmap returns.
+ *
+ * (future expr) works the same way with one thunk, (lambda () expr),
+ * run by a pool of threads that lives as long as the VM. The thunk
+ * sees the globals as they were when the future was made, and touch
+ * copies the result back the first time it's asked for.
+ */
+
+static uint32_t hash_cell(Cell * cell)
+{
+	uint64_t mixed = (uint64_t) (uintptr_t) cell * 0x9E3779B97F4A7C15ull;
+	return (uint32_t) (mixed >> 32);
+}
+
+static bool cell_comp(Cell * a, Cell * b)
+{
+	return a == b;
+}
+
+/*
+ * FUTURES
+ */
+
+struct Future_Pool {
+	std::mutex              lock;
+	std::condition_variable queued;   // Wakes the workers
+	std::condition_variable finished; // Wakes touch
+	Future *                head;
+	Future *                tail;
+	bool                    stopping;
+	std::thread *           threads;
+	int                     thread_count;
+};
+
+static void wait_for_future(Future * future)
+{
+	Future_Pool * pool = future->pool;
+	if (pool == NULL) return;
+	std::unique_lock<std::mutex> hold(pool->lock);
+	while (future->state != FUTURE_DONE) pool->finished.wait(hold);
+}
+
+/*
+ * COPYING BETWEEN VMS
+ */
+
+static Cell * copy_cell(Lisp_VM * to, Lisp_VM * from, Cell * cell, bool globals);
+
+struct Copier {
+	Lisp_VM *              to;
+	Lisp_VM *              from;
+	bool                   globals; // Bring along the global binding of each symbol met
+	HashTable<Cell*, Cell*> copies;
+	List<Cell*>            pending; // Originals whose copies have yet to be filled in
+
+	Symbol * symbol(Symbol * original);
+	Cell *   ref(Cell * original);
+	void     fill(Cell * original);
+};
+
+Symbol * Copier::symbol(Symbol * original)
+{
+	Symbol * symbol = to->intern(original->name);
+	if (globals && symbol->value == NULL && original->value != NULL) {
+		symbol->value = ref(original->value);
+	}
+	return symbol;
+}
+
+// Returns the copy of original, allocating it if it hasn't been met yet
+Cell * Copier::ref(Cell * original)
+{
+	if (original == NULL || is_fixnum(original)) return original;
+	if (original == from->nil)   return to->nil;
+	if (original == from->truth) return to->truth;
+	if (cell_type(original) == CELL_SYMBOL) return symbol(original->symbol)->cell;
+	Cell * copy;
+	if (copies.index(original, &copy) == 0) return copy;
+	if (cell_type(original) == CELL_PROCEDURE) copy = alloc_procedure(to, to->nil, 0);
+	else                                       copy = alloc_cell(to, cell_type(original));
+	copies.insert(original, copy);
+	pending.push(original);
+	return copy;
+}
+
+void Copier::fill(Cell * original)
+{
+	Cell * copy;
+	copies.index(original, &copy);
+	switch (cell_type(original)) {
+	case CELL_NUMBER:
+		copy->number = original->number;
+		break;
+	case CELL_CONS:
+		copy->cons.car = ref(original->cons.car);
+		copy->cons.cdr = ref(original->cons.cdr);
+		break;
+	case CELL_LAMBDA:
+		copy->lambda.code = ref(original->lambda.code);
+		copy->lambda.env  = ref(original->lambda.env);
+		break;
+	case CELL_ENVIRONMENT: {
+		Environment * frame = original->environment;
+		copy->environment = (Environment*) malloc(sizeof(Environment) + sizeof(Cell*) * frame->count);
+		copy->environment->parent   = ref(frame->parent);
+		copy->environment->params   = ref(frame->params);
+		copy->environment->count    = frame->count;
+		copy->environment->captured = frame->captured;
+		for (int i = 0; i < frame->count; i++) copy->environment->values[i] = ref(frame->values[i]);
+		break;
+	}
+	case CELL_PROCEDURE: {
+		// Native code stays behind; the copy earns its own
+		Procedure * procedure = original->procedure;
+		copy->procedure->source          = ref(procedure->source);
+		copy->procedure->arity           = procedure->arity;
+		copy->procedure->max_stack       = procedure->max_stack;
+		copy->procedure->has_environment = procedure->has_environment;
+		copy->procedure->code.push_many(procedure->code.arr, procedure->code.len);
+		for (int i = 0; i < procedure->constants.len; i++) {
+			copy->procedure->constants.push(ref(procedure->constants[i]));
+		}
+		break;
+	}
+	case CELL_VECTOR: {
+		size_t size = sizeof(int32_t) * original->vector->length;
+		copy->vector = (Vector*) malloc(sizeof(Vector) + size);
+		copy->vector->length = original->vector->length;
+		memcpy(copy->vector->data, original->vector->data, size);
+		note_payload(to, copy);
+		break;
+	}
+	case CELL_LOCAL:
+		copy->local.symbol = symbol(original->local.symbol);
+		copy->local.depth  = original->local.depth;
+		copy->local.index  = original->local.index;
+		break;
+	case CELL_CALL_SITE:
+		copy->call_site.symbol = symbol(original->call_site.symbol);
+		copy->call_site.callee = ref(original->call_site.callee);
+		break;
+	case CELL_FUTURE: {
+		// The thread running it answers to from alone, so the copy arrives already touched
+		Future * future = original->future;
+		wait_for_future(future);
+		Future * finished = (Future*) calloc(1, sizeof(Future));
+		finished->state = FUTURE_DONE;
+		if (future->error != NULL)      finished->error = strdup(future->error);
+		else if (future->value != NULL) finished->value = ref(future->value);
+		else                            finished->value = copy_cell(to, future->vm, future->result, false);
+		copy->future = finished;
+		break;
+	}
+	default:
+		assert(false);
+	}
+}
+
+/* Copies cell and everything reachable from it out of from's heap and
+ * into to's. Copies are old and collection is off until they're all
+ * filled in, so the caller only has to root the one returned.
+ */
+static Cell * copy_cell(Lisp_VM * to, Lisp_VM * from, Cell * cell, bool globals)
+{
+	Copier copier;
+	copier.to      = to;
+	copier.from    = from;
+	copier.globals = globals;
+	copier.copies.init(64, hash_cell, cell_comp);
+	copier.pending.alloc();
+	defer { copier.copies.dealloc(); copier.pending.dealloc(); };
+	to->gc_inhibit++;
+	defer { to->gc_inhibit--; };
+	Cell * copy = copier.ref(cell);
+	while (copier.pending.len > 0) copier.fill(copier.pending.pop());
+	return copy;
+}
+
+/*
+ * WORKERS
+ * The list is cut into chunks, and each worker starts with an even
+ * share of them in a row. A worker takes chunks from the front of its
+ * own share, and once that's empty, steals from the back of another's.
+ */
+
+// Chunks per worker, so there's something left to steal when the work is uneven
+#define PARALLEL_CHUNKS_PER_WORKER 8
+
+struct Chunk_Queue {
+	std::mutex lock;
+	int        next;
+	int        end;
+};
+
+struct Parallel_Job;
+
+struct Worker {
+	Parallel_Job * job;
+	int            index;
+	Lisp_VM        vm;
+	Cell *         function;
+	Cell *         initial;
+	Chunk_Queue    queue;
+};
+
+struct Parallel_Job {
+	Lisp_VM *         vm;
+	Special_Form      form;
+	Cell *            function;
+	Cell *            initial;
+	Cell **           items;
+	int               item_count;
+	int               chunk_size;
+	int               chunk_count;
+	Worker *          workers;
+	int               worker_count;
+	Cell **           results; // Per item for pmap, per chunk for preduce
+	int *             owners;  // Index of the worker whose heap each result is in
+	std::atomic<bool> failed;
+	std::mutex        error_lock;
+	int               error_chunk;
+	char              error[VM_ERROR_SIZE];
+};
+
+static bool take_chunk(Worker * worker, int * chunk)
+{
+	Parallel_Job * job = worker->job;
+	for (int i = 0; i < job->worker_count; i++) {
+		Chunk_Queue * queue = &job->workers[(worker->index + i) % job->worker_count].queue;
+		std::lock_guard<std::mutex> hold(queue->lock);
+		if (queue->next == queue->end) continue;
+		if (i == 0) *chunk = queue->next++;
+		else        *chunk = --queue->end;
+		return true;
+	}
+	return false;
+}
+
+static void fail(Worker * worker, int chunk)
+{
+	Parallel_Job * job = worker->job;
+	std::lock_guard<std::mutex> hold(job->error_lock);
+	// The earliest chunk's error is the one a serial run would have hit first
+	if (!job->failed || chunk < job->error_chunk) {
+		job->error_chunk = chunk;
+		strcpy(job->error, worker->vm.error);
+	}
+	worker->vm.thrown = false;
+	job->failed = true;
+}
+
+// Applies the worker's function to values, which must be rooted in the worker
+static Cell * call(Worker * worker, Cell * a, Cell * b)
+{
+	Lisp_VM * vm = &worker->vm;
+	Cell * arguments = vm->nil;
+	GC_ROOT(vm, arguments);
+	if (b != NULL) {
+		arguments = alloc_cell(vm, CELL_CONS);
+		arguments->cons.car = b;
+		arguments->cons.cdr = vm->nil;
+	}
+	Cell * cons = alloc_cell(vm, CELL_CONS);
+	cons->cons.car = a;
+	cons->cons.cdr = arguments;
+	arguments = cons;
+	return vm->apply(worker->function, arguments);
+}
+
+static void run_chunk(Worker * worker, int chunk)
+{
+	Parallel_Job * job = worker->job;
+	Lisp_VM * vm = &worker->vm;
+	int begin = chunk * job->chunk_size;
+	int end   = begin + job->chunk_size;
+	if (end > job->item_count) end = job->item_count;
+	// Results stay rooted until the worker's VM is freed, so they go below the scoped roots
+	int first = job->form == FORM_PMAP ? begin : chunk;
+	int last  = job->form == FORM_PMAP ? end : chunk + 1;
+	for (int i = first; i < last; i++) {
+		job->results[i] = NULL;
+		vm->push_root(&job->results[i]);
+	}
+	Cell * item = NULL;
+	Cell * accumulated = worker->initial;
+	GC_ROOT(vm, item);
+	GC_ROOT(vm, accumulated);
+	for (int i = begin; i < end && !job->failed; i++) {
+		item = copy_cell(vm, job->vm, job->items[i], true);
+		if (job->form == FORM_PMAP) {
+			Cell * result = call(worker, item, NULL);
+			if (result == NULL) return fail(worker, chunk);
+			job->results[i] = result;
+			job->owners[i]  = worker->index;
+		} else {
+			accumulated = call(worker, accumulated, item);
+			if (accumulated == NULL) return fail(worker, chunk);
+		}
+	}
+	if (job->form == FORM_PREDUCE) {
+		job->results[chunk] = accumulated;
+		job->owners[chunk]  = worker->index;
+	}
+}
+
+// Sets up a VM to run work for parent, on a thread that already has its share of it
+static void init_worker_vm(Lisp_VM * vm, Lisp_VM * parent)
+{
+	vm->init();
+	vm->interp  = parent->interp;
+	vm->jit     = parent->jit;
+	vm->out     = parent->out;
+	vm->caching = parent->caching;
+	vm->workers = 1;
+}
+
+static void run_worker(Worker * worker)
+{
+	Parallel_Job * job = worker->job;
+	Lisp_VM * vm = &worker->vm;
+	// The worker's VM has to outlive it, so its results can be copied out
+	init_worker_vm(vm, job->vm);
+	worker->function = copy_cell(vm, job->vm, job->function, true);
+	vm->push_root(&worker->function);
+	worker->initial = NULL;
+	if (job->initial != NULL) worker->initial = copy_cell(vm, job->vm, job->initial, true);
+	vm->push_root(&worker->initial);
+	int chunk;
+	while (!job->failed && take_chunk(worker, &chunk)) run_chunk(worker, chunk);
+}
+
+static int default_workers()
+{
+	int cores = std::thread::hardware_concurrency();
+	return cores > 0 ? cores : 1;
+}
+
+/*
+ * FUTURE POOL
+ * Futures run first come, first served. A thunk never waits on a
+ * future in the same pool: any future it can touch was either copied
+ * in already finished, or made by its own VM, which has its own pool.
+ */
+
+static void destroy_future(Future * future)
+{
+	if (future->vm != NULL) {
+		future->vm->dealloc();
+		free(future->vm);
+	}
+	free(future->error);
+	free(future);
+}
+
+static void run_future(Future * future)
+{
+	Lisp_VM * vm = future->vm;
+	future->result = vm->apply(future->thunk, vm->nil);
+	if (future->result == NULL) {
+		future->error = strdup(vm->error);
+		vm->thrown = false;
+	}
+}
+
+static void run_futures(Future_Pool * pool)
+{
+	std::unique_lock<std::mutex> hold(pool->lock);
+	while (true) {
+		while (pool->head == NULL && !pool->stopping) pool->queued.wait(hold);
+		if (pool->stopping) return;
+		Future * future = pool->head;
+		pool->head = future->next;
+		if (pool->head == NULL) pool->tail = NULL;
+		if (!future->abandoned) {
+			future->state = FUTURE_RUNNING;
+			hold.unlock();
+			run_future(future);
+			hold.lock();
+			future->state = FUTURE_DONE;
+			pool->finished.notify_all();
+		}
+		if (future->abandoned) {
+			hold.unlock();
+			destroy_future(future);
+			hold.lock();
+		}
+	}
+}
+
+static Future_Pool * future_pool(Lisp_VM * vm)
+{
+	if (vm->futures != NULL) return vm->futures;
+	Future_Pool * pool = new Future_Pool;
+	pool->head         = NULL;
+	pool->tail         = NULL;
+	pool->stopping     = false;
+	pool->thread_count = vm->workers > 0 ? vm->workers : default_workers();
+	pool->threads      = new std::thread[pool->thread_count];
+	for (int i = 0; i < pool->thread_count; i++) pool->threads[i] = std::thread(run_futures, pool);
+	vm->futures = pool;
+	return pool;
+}
+
+// Called by the collector, on the thread that made the future
+void free_future(Future * future)
+{
+	Future_Pool * pool = future->pool;
+	if (pool != NULL) {
+		std::lock_guard<std::mutex> hold(pool->lock);
+		if (future->state != FUTURE_DONE) {
+			future->abandoned = true;
+			return;
+		}
+	}
+	destroy_future(future);
+}
+
+void free_futures(Lisp_VM * vm)
+{
+	Future_Pool * pool = vm->futures;
+	if (pool == NULL) return;
+	{
+		std::lock_guard<std::mutex> hold(pool->lock);
+		pool->stopping = true;
+	}
+	pool->queued.notify_all();
+	for (int i = 0; i < pool->thread_count; i++) pool->threads[i].join();
+	// The heap went first, so anything still queued was abandoned with it
+	while (pool->head != NULL) {
+		Future * next = pool->head->next;
+		destroy_future(pool->head);
+		pool->head = next;
+	}
+	delete[] pool->threads;
+	delete pool;
+	vm->futures = NULL;
+}
+
+static Cell * start_future(Lisp_VM * vm, Cell * thunk)
+{
+	Future_Pool * pool = future_pool(vm);
+	Future * future = (Future*) calloc(1, sizeof(Future));
+	future->pool  = pool;
+	future->state = FUTURE_QUEUED;
+	future->vm    = (Lisp_VM*) malloc(sizeof(Lisp_VM));
+	init_worker_vm(future->vm, vm);
+	future->thunk = copy_cell(future->vm, vm, thunk, true);
+	future->vm->push_root(&future->thunk);
+	future->vm->push_root(&future->result);
+
+	Cell * cell = alloc_cell(vm, CELL_FUTURE);
+	cell->future = future;
+	{
+		std::lock_guard<std::mutex> hold(pool->lock);
+		if (pool->tail == NULL) pool->head = future;
+		else                    pool->tail->next = future;
+		pool->tail = future;
+	}
+	pool->queued.notify_one();
+	return cell;
+}
+
+static Cell * touch(Lisp_VM * vm, Cell * cell)
+{
+	// Anything that isn't a future is already its own value
+	if (cell_type(cell) != CELL_FUTURE) return cell;
+	Future * future = cell->future;
+	wait_for_future(future);
+	if (future->vm != NULL) {
+		// The first touch takes the result, and the future's VM isn't needed after that
+		if (future->error == NULL) {
+			future->value = copy_cell(vm, future->vm, future->result, false);
+			write_barrier(vm, cell, future->value);
+		}
+		future->vm->dealloc();
+		free(future->vm);
+		future->vm   = NULL;
+		future->pool = NULL;
+	}
+	if (future->error != NULL) return vm->throw_error("%s", future->error);
+	return future->value;
+}
+
+/*
+ * BUILTINS
+ */
+
+int parallel_form_arity(Special_Form form)
+{
+	switch (form) {
+	case FORM_PMAP:    return 2;
+	case FORM_PREDUCE: return 3;
+	case FORM_FUTURE:  return 1;
+	case FORM_TOUCH:   return 1;
+	default:           return -1;
+	}
+}
+
+// Runs pmap or preduce on the calling VM alone, when there's no one to share with
+static Cell * serial(Lisp_VM * vm, Special_Form form, Cell ** args)
+{
+	Cell * list = form == FORM_PMAP ? args[1] : args[2];
+	Cell * results = vm->nil;
+	Cell * accumulated = form == FORM_PREDUCE ? args[1] : NULL;
+	Cell * arguments = vm->nil;
+	Cell * last = NULL;
+	GC_ROOT(vm, list);
+	GC_ROOT(vm, results);
+	GC_ROOT(vm, accumulated);
+	GC_ROOT(vm, arguments);
+	GC_ROOT(vm, last);
+	for (; list != vm->nil; list = list->cons.cdr) {
+		arguments = alloc_cell(vm, CELL_CONS);
+		arguments->cons.car = list->cons.car;
+		arguments->cons.cdr = vm->nil;
+		if (form == FORM_PREDUCE) {
+			Cell * cons = alloc_cell(vm, CELL_CONS);
+			cons->cons.car = accumulated;
+			cons->cons.cdr = arguments;
+			arguments = cons;
+		}
+		Cell * result = vm->apply(args[0], arguments);
+		if (result == NULL) return NULL;
+		if (form == FORM_PREDUCE) {
+			accumulated = result;
+			continue;
+		}
+		GC_ROOT(vm, result);
+		Cell * cons = alloc_cell(vm, CELL_CONS);
+		cons->cons.car = result;
+		cons->cons.cdr = vm->nil;
+		if (last == NULL) {
+			results = cons;
+		} else {
+			last->cons.cdr = cons;
+			write_barrier(vm, last, cons);
+		}
+		last = cons;
+	}
+	return form == FORM_PMAP ? results : accumulated;
+}
+
+Cell * Lisp_VM::parallel_builtin(Special_Form form, Cell ** args)
+{
+	if (form == FORM_FUTURE) return start_future(this, args[0]);
+	if (form == FORM_TOUCH)  return touch(this, args[0]);
+
+	/* args are already evaluated and rooted. pmap's results are built
+	 * in input order. preduce reduces each chunk from init separately,
+	 * then combines the chunks' results in order, so f has to be
+	 * associative with init as its identity.
+	 */
+	const char * name = form == FORM_PMAP ? "pmap" : "preduce";
+	Cell * list = form == FORM_PMAP ? args[1] : args[2];
+	if (cell_type(args[0]) != CELL_LAMBDA) {
+		return throw_error("%s takes a function as its first argument.\n", name);
+	}
+	if (cell_type(list) != CELL_CONS) {
+		return throw_error("%s takes a list as its last argument.\n", name);
+	}
+	int item_count = 0;
+	for (Cell * cell = list; cell != nil; cell = cell->cons.cdr) {
+		if (cell_type(cell) != CELL_CONS) return throw_error("%s takes a proper list.\n", name);
+		item_count++;
+	}
+
+	int worker_count = workers > 0 ? workers : default_workers();
+	if (worker_count > item_count) worker_count = item_count;
+	if (worker_count <= 1) return serial(this, form, args);
+
+	Parallel_Job job;
+	job.vm           = this;
+	job.form         = form;
+	job.function     = args[0];
+	job.initial      = form == FORM_PREDUCE ? args[1] : NULL;
+	job.item_count   = item_count;
+	job.items        = (Cell**) malloc(sizeof(Cell*) * item_count);
+	int chunk_target = worker_count * PARALLEL_CHUNKS_PER_WORKER;
+	job.chunk_size   = (item_count + chunk_target - 1) / chunk_target;
+	job.chunk_count  = (item_count + job.chunk_size - 1) / job.chunk_size;
+	job.worker_count = worker_count;
+	job.workers      = new Worker[worker_count];
+	int result_count = form == FORM_PMAP ? item_count : job.chunk_count;
+	job.results      = (Cell**) malloc(sizeof(Cell*) * result_count);
+	job.owners       = (int*) malloc(sizeof(int) * result_count);
+	job.failed       = false;
+	defer {
+		for (int i = 0; i < worker_count; i++) job.workers[i].vm.dealloc();
+		delete[] job.workers;
+		free(job.items);
+		free(job.results);
+		free(job.owners);
+	};
+	Cell ** item = job.items;
+	for (Cell * cell = list; cell != nil; cell = cell->cons.cdr) *item++ = cell->cons.car;
+	for (int i = 0; i < worker_count; i++) {
+		Worker * worker = &job.workers[i];
+		worker->job   = &job;
+		worker->index = i;
+		worker->queue.next = job.chunk_count * i / worker_count;
+		worker->queue.end  = job.chunk_count * (i + 1) / worker_count;
+	}
+
+	// This thread runs the first worker rather than sitting idle
+	std::thread * threads = new std::thread[worker_count - 1];
+	for (int i = 1; i < worker_count; i++) threads[i - 1] = std::thread(run_worker, &job.workers[i]);
+	run_worker(&job.workers[0]);
+	for (int i = 1; i < worker_count; i++) threads[i - 1].join();
+	delete[] threads;
+
+	if (job.failed) return throw_error("%s", job.error);
+
+	Cell * results = nil;
+	GC_ROOT(this, results);
+	if (form == FORM_PMAP) {
+		// Built back to front, so each cons is allocated with its cdr already made
+		for (int i = item_count - 1; i >= 0; i--) {
+			Cell * result = copy_cell(this, &job.workers[job.owners[i]].vm, job.results[i], false);
+			GC_ROOT(this, result);
+			Cell * cons = alloc_cell(this, CELL_CONS);
+			cons->cons.car = result;
+			cons->cons.cdr = results;
+			results = cons;
+		}
+		return results;
+	}
+	Cell * accumulated = NULL;
+	Cell * arguments = nil;
+	GC_ROOT(this, accumulated);
+	GC_ROOT(this, arguments);
+	for (int i = 0; i < job.chunk_count; i++) {
+		Cell * result = copy_cell(this, &job.workers[job.owners[i]].vm, job.results[i], false);
+		if (accumulated == NULL) {
+			accumulated = result;
+			continue;
+		}
+		GC_ROOT(this, result);
+		arguments = alloc_cell(this, CELL_CONS);
+		arguments->cons.car = result;
+		arguments->cons.cdr = nil;
+		Cell * cons = alloc_cell(this, CELL_CONS);
+		cons->cons.car = accumulated;
+		cons->cons.cdr = arguments;
+		arguments = cons;
+		accumulated = apply(args[0], arguments);
+		if (accumulated == NULL) return NULL;
+	}
+	return accumulated;
+}
+
+/*
+ * LOADING
+ * Lexing and parsing don't depend on anything evaluated before, so the
+ * files named on the command line are each parsed into a VM of their
+ * own on worker threads, while the calling VM evaluates the ones
+ * before them. When a file's turn comes, the calling VM takes over
+ * the slabs its forms were built in rather than copying them, and only
+ * has to point their symbols at its own.
+ */
+
+struct Loaded_File {
+	char *  path;
+	Lisp_VM vm;
+	Cell *  forms; // In vm, or NULL if the file couldn't be opened
+	bool    ready;
+};
+
+struct Loader {
+	Lisp_VM *               vm;
+	Loaded_File *           files;
+	int                     file_count;
+	std::atomic<int>        next; // The next file a worker can take
+	std::mutex              lock;
+	std::condition_variable loaded;
+	std::thread *           threads;
+	int                     thread_count;
+};
+
+// Returns the file's forms as a list, or NULL if it can't be opened
+static Cell * read_file(Lisp_VM * vm, char * path)
+{
+	Reader reader;
+	if (!reader.open(vm, path)) return NULL;
+	// Nothing is rooted, so nothing may be collected until the caller has the list
+	vm->gc_inhibit++;
+	defer { vm->gc_inhibit--; };
+	Cell * forms = vm->nil;
+	Cell * last = NULL;
+	Cell * form;
+	while ((form = reader.read()) != NULL) {
+		Cell * cons = alloc_cell(vm, CELL_CONS);
+		cons->cons.car = form;
+		cons->cons.cdr = vm->nil;
+		if (last == NULL) forms = cons;
+		else              last->cons.cdr = cons;
+		last = cons;
+	}
+	reader.dealloc();
+	return forms;
+}
+
+/* Points a form from's reader built at to's nil and symbols instead,
+ * in place. Reader forms are trees, so no cons is visited twice, and
+ * each symbol's binding in from already holds its symbol cell in to.
+ */
+static Cell * translate_form(Lisp_VM * to, Lisp_VM * from, Cell * form)
+{
+	if (form == from->nil) return to->nil;
+	if (cell_type(form) == CELL_SYMBOL) return form->symbol->value;
+	if (cell_type(form) != CELL_CONS)   return form;
+	for (Cell * cons = form; ; cons = cons->cons.cdr) {
+		cons->cons.car = translate_form(to, from, cons->cons.car);
+		if (cell_type(cons->cons.cdr) != CELL_CONS || cons->cons.cdr == from->nil) {
+			cons->cons.cdr = translate_form(to, from, cons->cons.cdr);
+			break;
+		}
+	}
+	return form;
+}
+
+static void run_loader(Loader * loader)
+{
+	int index;
+	while ((index = loader->next++) < loader->file_count) {
+		Loaded_File * file = &loader->files[index];
+		init_worker_vm(&file->vm, loader->vm);
+		file->forms = read_file(&file->vm, file->path);
+		std::lock_guard<std::mutex> hold(loader->lock);
+		file->ready = true;
+		loader->loaded.notify_all();
+	}
+}
+
+Loader * start_loading(Lisp_VM * vm, char ** paths, int count)
+{
+	// A single file has nothing to overlap with, and a single worker has no one to share with
+	int thread_count = vm->workers > 0 ? vm->workers : default_workers();
+	if (thread_count > count) thread_count = count;
+	if (thread_count <= 1)    return NULL;
+	Loader * loader = new Loader;
+	loader->vm         = vm;
+	loader->file_count = count;
+	loader->files      = new Loaded_File[count];
+	loader->next       = 0;
+	for (int i = 0; i < count; i++) {
+		loader->files[i].path  = paths[i];
+		loader->files[i].ready = false;
+	}
+	loader->thread_count = thread_count;
+	loader->threads = new std::thread[thread_count];
+	for (int i = 0; i < loader->thread_count; i++) loader->threads[i] = std::thread(run_loader, loader);
+	return loader;
+}
+
+Cell * take_loaded(Loader * loader, int index)
+{
+	Lisp_VM * vm = loader->vm;
+	Loaded_File * file = &loader->files[index];
+	{
+		std::unique_lock<std::mutex> hold(loader->lock);
+		while (!file->ready) loader->loaded.wait(hold);
+	}
+	Lisp_VM * from = &file->vm;
+	defer { from->dealloc(); };
+	if (file->forms == NULL) return NULL;
+	// from is done with, so its symbols' bindings are free to hold what they translate to
+	HashTable<Name, Symbol*> & symbols = from->symbols;
+	for (int i = 0; i < symbols.table_size; i++) {
+		if (symbols.table[i].filled) symbols.table[i].value->value = vm->intern(symbols.table[i].value->name)->cell;
+	}
+	// Collection is off in from, so everything it built is old
+	Cell * forms = translate_form(vm, from, file->forms);
+	adopt_heap(vm, from);
+	return forms;
+}
+
+void stop_loading(Loader * loader)
+{
+	for (int i = 0; i < loader->thread_count; i++) loader->threads[i].join();
+	delete[] loader->threads;
+	delete[] loader->files;
+	delete loader;
+}
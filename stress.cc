@@ -0,0 +1,93 @@
+#include <thread>
+#include <atomic>
+
+/*
+ * VM STRESS TEST
+ * Runs a program that allocates and collects on many VMs at once, one
+ * thread each, and checks every run prints what a lone VM prints. The
+ * interpreters take turns by thread, so all of them share the process.
+ *
+ *     make stress && ./_stress [threads] [runs per thread]
+ */
+
+// Pulls in the interpreter, keeping its main out of the way
+#define main lithp_main
+#include "main.cc"
+#undef main
+
+static char * program =
+	"(set make-adder (lambda (n) (lambda (x) (+ x n))))\n"
+	"(set churn (lambda (n acc)\n"
+	"  (if (= n 0) acc\n"
+	"    (churn (- n 1) (+ acc ((make-adder n)\n"
+	"      (vsum (v+ (make-vector 16 n) (make-vector 16 1)))))))))\n"
+	"(set keep (make-vector 1000 7))\n"
+	"(print (churn 10000 0))\n"
+	"(gc)\n"
+	"(print (churn 10000 1))\n"
+	"(vector-set! keep 999 (churn 100 0))\n"
+	"(gc)\n"
+	"(print (vsum keep))\n";
+
+struct Mode {
+	Interp_Mode interp;
+	bool        jit;
+};
+
+static Mode modes[] = {
+	{ INTERP_TREE,     false },
+	{ INTERP_BYTECODE, false },
+	{ INTERP_BYTECODE, true  },
+};
+#define MODE_COUNT (sizeof(modes) / sizeof(modes[0]))
+
+// Returns everything the program printed, which the caller frees
+static char * run_program(Mode mode)
+{
+	Lisp_VM vm;
+	vm.init();
+	vm.interp = mode.interp;
+	vm.jit    = mode.jit;
+	char * output;
+	size_t output_len;
+	vm.out = open_memstream(&output, &output_len);
+	Reader reader;
+	reader.init(&vm, program);
+	run(&vm, &reader, false);
+	reader.dealloc();
+	vm.dealloc();
+	fclose(vm.out);
+	return output;
+}
+
+int main(int argc, char ** argv)
+{
+	int threads = argc > 1 ? atoi(argv[1]) : 8;
+	int runs    = argc > 2 ? atoi(argv[2]) : 10;
+
+	char * expected[MODE_COUNT];
+	for (size_t i = 0; i < MODE_COUNT; i++) expected[i] = run_program(modes[i]);
+
+	std::atomic<int> mismatches(0);
+	List<std::thread*> workers;
+	workers.alloc();
+	for (int i = 0; i < threads; i++) {
+		workers.push(new std::thread([&, i] {
+			int mode = i % MODE_COUNT;
+			for (int run = 0; run < runs; run++) {
+				char * output = run_program(modes[mode]);
+				if (strcmp(output, expected[mode]) != 0) mismatches++;
+				free(output);
+			}
+		}));
+	}
+	for (int i = 0; i < workers.len; i++) {
+		workers[i]->join();
+		delete workers[i];
+	}
+	workers.dealloc();
+
+	printf("%d threads, %d runs: %d mismatched\n", threads, threads * runs, mismatches.load());
+	for (size_t i = 0; i < MODE_COUNT; i++) free(expected[i]);
+	return mismatches.load() == 0 ? 0 : 1;
+}
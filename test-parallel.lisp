@@ -0,0 +1,38 @@
+(set burn
+	 (lambda (n acc)
+	   (if (= n 0)
+		   acc
+		 (burn (- n 1) (+ acc (vsum (make-vector 8 1)))))))
+
+(set heavy
+	 (lambda (x)
+	   (progn (burn 20000 0)
+			  (make-vector 4 x))))
+
+(set add
+	 (lambda (a b)
+	   (progn (burn 2000 0)
+			  (vsum (v+ (make-vector 1 a) (make-vector 1 b))))))
+
+(set numbers (quote (1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16)))
+
+(print (pmap heavy numbers))
+(print (= (preduce add 0 numbers) 136))
+(print (preduce add 0 (pmap (lambda (x) (vsum (heavy x))) numbers)))
+
+
+(set sum
+	 (lambda (a b)
+	   (+ a b)))
+
+(set more (quote (1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39 40 41 42 43 44 45 46 47 48 49 50 51 52 53 54 55 56 57 58 59 60 61 62 63 64)))
+
+(set rounds
+	 (lambda (n acc)
+	   (if (= n 0)
+		   acc
+		 (rounds (- n 1)
+				 (+ acc (preduce sum 0 (pmap (lambda (v) (vsum v))
+											 (pmap (lambda (x) (make-vector 3 x)) more))))))))
+
+(print (rounds 300 0))
@@ -0,0 +1,409 @@
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LITHP_X86 1
+#else
+#define LITHP_X86 0
+#endif
+
+/*
+ * KERNELS
+ * Arithmetic wraps like the scalar primitives do, so every variant
+ * gives the same answer whatever order it adds in.
+ */
+
+struct Vector_Kernels {
+	int32_t (*sum)(const int32_t * a, int n);
+	int32_t (*dot)(const int32_t * a, const int32_t * b, int n);
+	void    (*add)(int32_t * out, const int32_t * a, const int32_t * b, int n);
+	void    (*scale)(int32_t * out, const int32_t * a, int32_t k, int n);
+	int32_t (*min)(const int32_t * a, int n);
+	int32_t (*max)(const int32_t * a, int n);
+};
+
+static int32_t sum_scalar(const int32_t * a, int n)
+{
+	uint32_t acc = 0;
+	for (int i = 0; i < n; i++) acc += (uint32_t) a[i];
+	return (int32_t) acc;
+}
+
+static int32_t dot_scalar(const int32_t * a, const int32_t * b, int n)
+{
+	uint32_t acc = 0;
+	for (int i = 0; i < n; i++) acc += (uint32_t) a[i] * (uint32_t) b[i];
+	return (int32_t) acc;
+}
+
+static void add_scalar(int32_t * out, const int32_t * a, const int32_t * b, int n)
+{
+	for (int i = 0; i < n; i++) out[i] = (int32_t) ((uint32_t) a[i] + (uint32_t) b[i]);
+}
+
+static void scale_scalar(int32_t * out, const int32_t * a, int32_t k, int n)
+{
+	for (int i = 0; i < n; i++) out[i] = (int32_t) ((uint32_t) a[i] * (uint32_t) k);
+}
+
+static int32_t min_scalar(const int32_t * a, int n)
+{
+	int32_t acc = a[0];
+	for (int i = 1; i < n; i++) if (a[i] < acc) acc = a[i];
+	return acc;
+}
+
+static int32_t max_scalar(const int32_t * a, int n)
+{
+	int32_t acc = a[0];
+	for (int i = 1; i < n; i++) if (a[i] > acc) acc = a[i];
+	return acc;
+}
+
+static const Vector_Kernels scalar_kernels = {
+	sum_scalar, dot_scalar, add_scalar, scale_scalar, min_scalar, max_scalar,
+};
+
+#if LITHP_X86
+
+/* Each SIMD variant does whole registers and hands the remainder to
+ * the scalar kernel. They're compiled for their instruction set with
+ * target attributes, so the rest of the build stays baseline.
+ */
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2  __attribute__((target("avx2")))
+
+SSE41 static int32_t horizontal_sum_sse41(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+SSE41 static int32_t sum_sse41(const int32_t * a, int n)
+{
+	__m128i acc = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*) (a + i)));
+	}
+	return (int32_t) ((uint32_t) horizontal_sum_sse41(acc) + (uint32_t) sum_scalar(a + i, n - i));
+}
+
+SSE41 static int32_t dot_sse41(const int32_t * a, const int32_t * b, int n)
+{
+	__m128i acc = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+		__m128i y = _mm_loadu_si128((const __m128i*) (b + i));
+		acc = _mm_add_epi32(acc, _mm_mullo_epi32(x, y));
+	}
+	return (int32_t) ((uint32_t) horizontal_sum_sse41(acc) + (uint32_t) dot_scalar(a + i, b + i, n - i));
+}
+
+SSE41 static void add_sse41(int32_t * out, const int32_t * a, const int32_t * b, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+		__m128i y = _mm_loadu_si128((const __m128i*) (b + i));
+		_mm_storeu_si128((__m128i*) (out + i), _mm_add_epi32(x, y));
+	}
+	add_scalar(out + i, a + i, b + i, n - i);
+}
+
+SSE41 static void scale_sse41(int32_t * out, const int32_t * a, int32_t k, int n)
+{
+	__m128i factor = _mm_set1_epi32(k);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+		_mm_storeu_si128((__m128i*) (out + i), _mm_mullo_epi32(x, factor));
+	}
+	scale_scalar(out + i, a + i, k, n - i);
+}
+
+SSE41 static int32_t min_sse41(const int32_t * a, int n)
+{
+	if (n < 4) return min_scalar(a, n);
+	__m128i acc = _mm_loadu_si128((const __m128i*) a);
+	int i = 4;
+	for (; i + 4 <= n; i += 4) {
+		acc = _mm_min_epi32(acc, _mm_loadu_si128((const __m128i*) (a + i)));
+	}
+	int32_t lanes[4];
+	_mm_storeu_si128((__m128i*) lanes, acc);
+	int32_t result = min_scalar(lanes, 4);
+	if (i < n) {
+		int32_t rest = min_scalar(a + i, n - i);
+		if (rest < result) result = rest;
+	}
+	return result;
+}
+
+SSE41 static int32_t max_sse41(const int32_t * a, int n)
+{
+	if (n < 4) return max_scalar(a, n);
+	__m128i acc = _mm_loadu_si128((const __m128i*) a);
+	int i = 4;
+	for (; i + 4 <= n; i += 4) {
+		acc = _mm_max_epi32(acc, _mm_loadu_si128((const __m128i*) (a + i)));
+	}
+	int32_t lanes[4];
+	_mm_storeu_si128((__m128i*) lanes, acc);
+	int32_t result = max_scalar(lanes, 4);
+	if (i < n) {
+		int32_t rest = max_scalar(a + i, n - i);
+		if (rest > result) result = rest;
+	}
+	return result;
+}
+
+static const Vector_Kernels sse41_kernels = {
+	sum_sse41, dot_sse41, add_sse41, scale_sse41, min_sse41, max_sse41,
+};
+
+AVX2 static int32_t horizontal_sum_avx2(__m256i v)
+{
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(half);
+}
+
+AVX2 static int32_t sum_avx2(const int32_t * a, int n)
+{
+	// Two accumulators so consecutive adds don't wait on each other
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		acc0 = _mm256_add_epi32(acc0, _mm256_loadu_si256((const __m256i*) (a + i)));
+		acc1 = _mm256_add_epi32(acc1, _mm256_loadu_si256((const __m256i*) (a + i + 8)));
+	}
+	int32_t head = horizontal_sum_avx2(_mm256_add_epi32(acc0, acc1));
+	return (int32_t) ((uint32_t) head + (uint32_t) sum_scalar(a + i, n - i));
+}
+
+AVX2 static int32_t dot_avx2(const int32_t * a, const int32_t * b, int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+		acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(x, y));
+	}
+	return (int32_t) ((uint32_t) horizontal_sum_avx2(acc) + (uint32_t) dot_scalar(a + i, b + i, n - i));
+}
+
+AVX2 static void add_avx2(int32_t * out, const int32_t * a, const int32_t * b, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+		_mm256_storeu_si256((__m256i*) (out + i), _mm256_add_epi32(x, y));
+	}
+	add_scalar(out + i, a + i, b + i, n - i);
+}
+
+AVX2 static void scale_avx2(int32_t * out, const int32_t * a, int32_t k, int n)
+{
+	__m256i factor = _mm256_set1_epi32(k);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+		_mm256_storeu_si256((__m256i*) (out + i), _mm256_mullo_epi32(x, factor));
+	}
+	scale_scalar(out + i, a + i, k, n - i);
+}
+
+AVX2 static int32_t min_avx2(const int32_t * a, int n)
+{
+	if (n < 8) return min_sse41(a, n);
+	__m256i acc = _mm256_loadu_si256((const __m256i*) a);
+	int i = 8;
+	for (; i + 8 <= n; i += 8) {
+		acc = _mm256_min_epi32(acc, _mm256_loadu_si256((const __m256i*) (a + i)));
+	}
+	int32_t lanes[8];
+	_mm256_storeu_si256((__m256i*) lanes, acc);
+	int32_t result = min_scalar(lanes, 8);
+	if (i < n) {
+		int32_t rest = min_scalar(a + i, n - i);
+		if (rest < result) result = rest;
+	}
+	return result;
+}
+
+AVX2 static int32_t max_avx2(const int32_t * a, int n)
+{
+	if (n < 8) return max_sse41(a, n);
+	__m256i acc = _mm256_loadu_si256((const __m256i*) a);
+	int i = 8;
+	for (; i + 8 <= n; i += 8) {
+		acc = _mm256_max_epi32(acc, _mm256_loadu_si256((const __m256i*) (a + i)));
+	}
+	int32_t lanes[8];
+	_mm256_storeu_si256((__m256i*) lanes, acc);
+	int32_t result = max_scalar(lanes, 8);
+	if (i < n) {
+		int32_t rest = max_scalar(a + i, n - i);
+		if (rest > result) result = rest;
+	}
+	return result;
+}
+
+static const Vector_Kernels avx2_kernels = {
+	sum_avx2, dot_avx2, add_avx2, scale_avx2, min_avx2, max_avx2,
+};
+
+#undef SSE41
+#undef AVX2
+
+#endif
+
+static const Vector_Kernels * select_kernels()
+{
+	// Build with -DLITHP_NO_SIMD to compare against the scalar kernels
+#if LITHP_X86 && !LITHP_NO_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))   return &avx2_kernels;
+	if (__builtin_cpu_supports("sse4.1")) return &sse41_kernels;
+#endif
+	return &scalar_kernels;
+}
+
+// Picked before main runs and never changed, so every VM can share them
+static const Vector_Kernels * const kernels = select_kernels();
+
+/*
+ * BUILTINS
+ */
+
+Cell * alloc_vector(Lisp_VM * vm, int length)
+{
+	Cell * cell = alloc_cell(vm, CELL_VECTOR);
+	cell->vector = (Vector*) malloc(sizeof(Vector) + sizeof(int32_t) * length);
+	cell->vector->length = length;
+	note_payload(vm, cell);
+	DEBUG_TAG(cell, "VECTOR");
+	return cell;
+}
+
+int vector_form_arity(Special_Form form)
+{
+	switch (form) {
+	case FORM_MAKE_VECTOR: return 2;
+	case FORM_VECTOR_REF:  return 2;
+	case FORM_VECTOR_SET:  return 3;
+	case FORM_LENGTH:      return 1;
+	case FORM_VSUM:        return 1;
+	case FORM_VDOT:        return 2;
+	case FORM_VADD:        return 2;
+	case FORM_VSCALE:      return 2;
+	case FORM_VMIN:        return 1;
+	case FORM_VMAX:        return 1;
+	default:               return -1;
+	}
+}
+
+char * arity_text(int arity)
+{
+	switch (arity) {
+	case 0:  return "no arguments";
+	case 1:  return "one argument";
+	case 2:  return "two arguments";
+	default: return "three arguments";
+	}
+}
+
+Cell * Lisp_VM::vector_builtin(Special_Form form, Cell ** args)
+{
+	/* args are already evaluated. They're in rooted slots, so they have
+	 * to be reread rather than cached across an allocation.
+	 */
+	switch (form) {
+	case FORM_MAKE_VECTOR: {
+		if (cell_type(args[0]) != CELL_NUMBER || cell_type(args[1]) != CELL_NUMBER) {
+			return throw_error("make-vector takes a length and a number.\n");
+		}
+		int length = cell_number(args[0]);
+		int fill   = cell_number(args[1]);
+		if (length < 0) return throw_error("make-vector length must not be negative.\n");
+		Cell * result = alloc_vector(this, length);
+		for (int i = 0; i < length; i++) result->vector->data[i] = fill;
+		return result;
+	}
+	case FORM_LENGTH:
+		if (cell_type(args[0]) == CELL_VECTOR) {
+			return make_number(this, args[0]->vector->length);
+		} else if (cell_type(args[0]) == CELL_CONS) {
+			return make_number(this, list_length(this, args[0]));
+		}
+		return throw_error("length takes a vector or a list.\n");
+	case FORM_VECTOR_REF:
+	case FORM_VECTOR_SET: {
+		const char * name = form == FORM_VECTOR_REF ? "vector-ref" : "vector-set!";
+		if (cell_type(args[0]) != CELL_VECTOR || cell_type(args[1]) != CELL_NUMBER) {
+			return throw_error("%s takes a vector and an index.\n", name);
+		}
+		Vector * vector = args[0]->vector;
+		int      index  = cell_number(args[1]);
+		if (index < 0 || index >= vector->length) {
+			return throw_error("%s index %d out of range.\n", name, index);
+		}
+		if (form == FORM_VECTOR_REF) return make_number(this, vector->data[index]);
+		if (cell_type(args[2]) != CELL_NUMBER) {
+			return throw_error("vector-set! stores numbers only.\n");
+		}
+		vector->data[index] = cell_number(args[2]);
+		return args[2];
+	}
+	case FORM_VSUM:
+	case FORM_VMIN:
+	case FORM_VMAX: {
+		const char * name = form == FORM_VSUM ? "vsum" : form == FORM_VMIN ? "vmin" : "vmax";
+		if (cell_type(args[0]) != CELL_VECTOR) {
+			return throw_error("%s takes a vector.\n", name);
+		}
+		Vector * vector = args[0]->vector;
+		if (form == FORM_VSUM) return make_number(this, kernels->sum(vector->data, vector->length));
+		if (vector->length == 0) return throw_error("%s of an empty vector.\n", name);
+		if (form == FORM_VMIN) return make_number(this, kernels->min(vector->data, vector->length));
+		return make_number(this, kernels->max(vector->data, vector->length));
+	}
+	case FORM_VDOT:
+	case FORM_VADD: {
+		const char * name = form == FORM_VDOT ? "vdot" : "v+";
+		if (cell_type(args[0]) != CELL_VECTOR || cell_type(args[1]) != CELL_VECTOR) {
+			return throw_error("%s takes two vectors.\n", name);
+		}
+		int length = args[0]->vector->length;
+		if (args[1]->vector->length != length) {
+			return throw_error("%s takes vectors of the same length.\n", name);
+		}
+		if (form == FORM_VDOT) {
+			return make_number(this, kernels->dot(args[0]->vector->data, args[1]->vector->data, length));
+		}
+		Cell * result = alloc_vector(this, length);
+		kernels->add(result->vector->data, args[0]->vector->data, args[1]->vector->data, length);
+		return result;
+	}
+	case FORM_VSCALE: {
+		if (cell_type(args[0]) != CELL_VECTOR || cell_type(args[1]) != CELL_NUMBER) {
+			return throw_error("vmap-scale takes a vector and a number.\n");
+		}
+		int length = args[0]->vector->length;
+		Cell * result = alloc_vector(this, length);
+		kernels->scale(result->vector->data, args[0]->vector->data, cell_number(args[1]), length);
+		return result;
+	}
+	default:
+		assert(0);
+		return NULL;
+	}
+}
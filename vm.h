@@ -2,51 +2,365 @@
 #define LITHP_VM_H
 
 #include <stdarg.h>
+#include <stdint.h>
 #include "ds_util.h"
 
-enum Cell_Type {
+enum Cell_Type : uint8_t {
 	CELL_SYMBOL,
 	CELL_NUMBER,
 	CELL_CONS,
+	CELL_LAMBDA,
+	CELL_ENVIRONMENT,
+	CELL_PROCEDURE,
+	CELL_VECTOR,
+	CELL_LOCAL,     // A parameter reference, resolved to its frame slot
+	CELL_CALL_SITE, // A global in call position, with an inline cache of its callee
+	CELL_FUTURE,    // A value being computed on another thread (see parallel.cc)
+	CELL_FREE,      // Unallocated slot in a slab
+	CELL_FORWARD,   // Evacuated from the nursery; cons.car is the new copy
 };
 
+enum Special_Form {
+	FORM_NONE,
+	// Essential
+	FORM_SET,
+	FORM_QUOTE,
+	FORM_IF,
+	FORM_EQUAL,
+	FORM_PROGN,
+	FORM_LAMBDA,
+	// Builtin math, in the order of their operators in "+-*/%"
+	FORM_ADD,
+	FORM_SUB,
+	FORM_MUL,
+	FORM_DIV,
+	FORM_MOD,
+	FORM_SQRT,
+	// I/O
+	FORM_PRINT,
+	// Memory
+	FORM_GC,
+	// Vectors
+	FORM_MAKE_VECTOR,
+	FORM_VECTOR_REF,
+	FORM_VECTOR_SET,
+	FORM_LENGTH,
+	FORM_VSUM,
+	FORM_VDOT,
+	FORM_VADD,
+	FORM_VSCALE,
+	FORM_VMIN,
+	FORM_VMAX,
+	// Parallel
+	FORM_PMAP,
+	FORM_PREDUCE,
+	FORM_FUTURE,
+	FORM_TOUCH,
+};
+
+/* Identifiers are interned once by the lexer, so symbols can be
+ * compared by pointer and their hash never has to be recomputed.
+ */
+// Characters that needn't be NUL-terminated, like a word still in the reader's buffer
+struct Name {
+	char * str;
+	int    len;
+};
+
+struct Symbol {
+	char *       name;
+	uint32_t     hash;
+	Special_Form form;
+	struct Cell * cell;  // The one symbol cell for this name, shared by every read of it
+	struct Cell * value; // Global binding, or NULL while unbound
+};
+
+struct Cell;
+struct Procedure;
+struct Call_Frame;
+struct Future_Pool;
+struct Lisp_VM;
+
+/* A single frame of a lexical environment. Values line up with the
+ * parameter list of the lambda that created the frame.
+ */
+struct Environment {
+	Cell * parent; // Enclosing frame, or NIL for the global scope
+	Cell * params;
+	int    count;
+	bool   captured; // A closure holds on to this frame
+	Cell * values[];
+};
+
+// Unboxed numbers, laid out contiguously for the SIMD kernels in vector.cc
+struct Vector {
+	int     length;
+	int32_t data[];
+};
+
+enum Future_State {
+	FUTURE_QUEUED,
+	FUTURE_RUNNING,
+	FUTURE_DONE,
+};
+
+/* (future expr) in flight. Its thunk runs in a VM of its own, on one
+ * of the threads in the pool of the VM that made it (see parallel.cc).
+ */
+struct Future {
+	Future_Pool * pool;      // NULL once there's nothing left to wait for
+	Future *      next;      // Behind it in the queue
+	Future_State  state;
+	bool          abandoned; // Its cell was collected first, so the pool frees it
+	Lisp_VM *     vm;        // Runs the thunk, until the result is copied out
+	Cell *        thunk;     // In vm
+	Cell *        result;    // In vm
+	Cell *        value;     // In the heap of the VM that made it, once touched
+	char *        error;     // What the thunk threw, if it did
+};
+
+/* Cells are two words. Their type and mark bit live in a side table
+ * at the start of the slab they were carved from (see Slab below).
+ */
 struct Cell {
-	Cell_Type cell_type;
 	union {
-		char * symbol;
-		int    number;
+		Symbol * symbol;
+		int      number;
 		struct {
 			Cell * car;
 			Cell * cdr;
 		} cons;
+		struct {
+			Cell * code; // ((params...) body), or a compiled procedure
+			Cell * env;
+		} lambda;
+		Environment * environment;
+		Procedure *   procedure;
+		Vector *      vector;
+		Future *      future;
+		struct {
+			Symbol * symbol; // Kept for printing
+			int      depth;  // Frames to walk up from the innermost
+			int      index;
+		} local;
+		struct {
+			Symbol * symbol;
+			Cell *   callee; // Last lambda called from here, or NULL
+		} call_site;
 	};
+#if LITHP_DEBUG
 	char * _debug_tag;
+#endif
 };
 
+#if LITHP_DEBUG
+#define DEBUG_TAG(cell, tag) ((cell)->_debug_tag = (tag))
+#else
+#define DEBUG_TAG(cell, tag) ((void) 0)
+static_assert(sizeof(Cell) == 2 * sizeof(void*), "Cell should be two words");
+#endif
+
+/* The heap is made of SLAB_SIZE blocks aligned to their size, so the
+ * slab holding a cell is found by masking its address. Each slab
+ * starts with a type byte, a mark bit and a remembered bit per cell
+ * slot; the slots the header itself covers are never handed out.
+ *
+ * New cells are bump-allocated in a nursery of young slabs. Survivors
+ * of a minor collection are copied into the old slabs, which are
+ * managed by mark-and-sweep.
+ */
+#define SLAB_SIZE  (1 << 16)
+#define SLAB_CELLS (SLAB_SIZE / sizeof(Cell))
+
+struct Slab {
+	uint8_t  types[SLAB_CELLS];
+	uint64_t marks[(SLAB_CELLS + 63) / 64];
+	uint64_t remembered[(SLAB_CELLS + 63) / 64]; // Old cells in the remembered set
+	bool     young;
+};
+
+#define SLAB_FIRST_CELL ((sizeof(Slab) + sizeof(Cell) - 1) / sizeof(Cell))
+
+inline Slab * slab_of(Cell * cell)
+{
+	return (Slab*) ((uintptr_t) cell & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+inline int slab_index(Cell * cell)
+{
+	return ((uintptr_t) cell & (SLAB_SIZE - 1)) / sizeof(Cell);
+}
+
+#define VM_STACK_SIZE (1 << 20)
+#define VM_FRAME_MAX  (1 << 18)
+#define VM_ERROR_SIZE 1024
+// Old cells allocated before the first full collection is triggered
+#define GC_MIN_THRESHOLD (1 << 16)
+// Slabs in the nursery; a minor collection runs each time it fills
+#define NURSERY_SLABS 8
+// Cells' worth of vector storage that also triggers a minor collection
+#define NURSERY_PAYLOAD_MAX (1 << 18)
+// Largest frame the tree-walker will overwrite for a tail call
+#define FRAME_REUSE_MAX 16
+
+/* Integers are stored directly in the Cell pointer with the low bit
+ * set, which real cells never have since they're word-aligned. Only
+ * numbers too wide for the pointer (on 32-bit hosts) get a boxed
+ * CELL_NUMBER.
+ */
+inline bool is_fixnum(Cell * cell)
+{
+	return ((uintptr_t) cell & 1) != 0;
+}
+
+inline bool fixnum_fits(int number)
+{
+	return sizeof(Cell*) > sizeof(int) ||
+		(number >= INTPTR_MIN / 2 && number <= INTPTR_MAX / 2);
+}
+
+inline Cell * make_fixnum(int number)
+{
+	return (Cell*) (((uintptr_t) (intptr_t) number << 1) | 1);
+}
+
+inline int fixnum_value(Cell * cell)
+{
+	return (int) ((intptr_t) cell >> 1);
+}
+
+inline bool is_young(Cell * cell)
+{
+	return !is_fixnum(cell) && slab_of(cell)->young;
+}
+
+inline Cell_Type cell_type(Cell * cell)
+{
+	if (is_fixnum(cell)) return CELL_NUMBER;
+	return (Cell_Type) slab_of(cell)->types[slab_index(cell)];
+}
+
+inline int cell_number(Cell * cell)
+{
+	return is_fixnum(cell) ? fixnum_value(cell) : cell->number;
+}
+
+/* Keeps a local Cell * reachable for the rest of the enclosing scope,
+ * and updates it if the cell is moved out of the nursery. Anything
+ * held in a C++ local across a call that can allocate has to be
+ * rooted, or the collector may free or move it.
+ */
+#define GC_ROOT(vm, var) (vm)->push_root(&(var)); defer { (vm)->pop_roots(1); }
+
+enum Interp_Mode {
+	INTERP_BYTECODE,
+	INTERP_TREE,
+};
+
+/* Everything a program can reach hangs off its VM, and what's shared
+ * between VMs is fixed before main runs. So any number of them can run
+ * at once, as long as each is only used by one thread at a time.
+ */
 struct Lisp_VM {
-	HashTable<char*, Cell*> bindings;
+	HashTable<Name, Symbol*> symbols;
 	Cell * truth;
 	Cell * nil;
 
-	char * err_str;
+	char error[VM_ERROR_SIZE]; // Message for display_error, while thrown
 	bool thrown;
+	FILE * out; // Where print and evaluated results go
+
+	Interp_Mode interp;
+	bool        jit; // Compile hot procedures to native code
+	bool        optimizing;     // Fold constants before evaluating (see optimize.cc)
+	bool        dump_optimized; // Print each form the optimizer rewrote
+	bool        caching;        // Keep parsed forms beside source files (see cache.cc)
+	int         workers;        // Threads pmap, preduce and futures share work between (see parallel.cc)
+	Future_Pool * futures;      // Started by the first future
+
+	// Garbage collector
+	List<Slab*>  nursery;
+	int          nursery_slab; // Slab young_bump points into
+	Cell *       young_bump;
+	Cell *       young_end;
+	List<Cell*>  remembered;   // Old cells that may point into the nursery
+	List<Slab*>  slabs;        // Old space
+	Cell *       free_list;    // Swept cells, threaded through cons.car
+	Cell *       bump;         // Next untouched cell in the newest slab
+	Cell *       bump_end;
+	int          heap_cells;   // Old cells not yet freed, plus their vector storage
+	int          young_payload; // Vector storage held by young cells, in cells
+	List<Cell**> roots;        // Locals holding cells across allocations
+	int          gc_threshold; // Heap size that triggers the next collection
+	int          gc_inhibit;   // Collection is deferred while non-zero
+
+	// Bytecode interpreter state
+	Cell **      stack;
+	Cell **      stack_top;
+	Cell **      stack_end;
+	Call_Frame * frames;
+	int          frame_count;
+	int          frame_max;
 
 	void   init();
-	Cell * evaluate(Cell * cell);
-	Cell * special_form(Cell * form, Cell * arguments);
-	Cell * apply_function(Cell * to_call, Cell * arguments);
-	void substitute_arguments(Cell * procedure, char * param, Cell * arg);
+	void   dealloc();
+	void   push_root(Cell ** root) { roots.push(root); }
+	void   pop_roots(int count)     { roots.len -= count; }
+	void   remember(Cell * cell);
+	void   collect_nursery();
+	int    collect();
+	Symbol * intern(char * name);
+	Symbol * intern(Name name);
+	Cell * evaluate(Cell * form);
+	Cell * apply(Cell * function, Cell * arguments); // arguments are already evaluated
+	Cell * execute(Cell * procedure);
+	Cell * run(int entry);
+	Cell * evaluate(Cell * cell, Cell * env);
+	Cell * lookup(Cell * reference, Cell * env);
+	Cell * special_form(Cell * form, Cell * arguments, Cell * env);
+	Cell * bind_arguments(Cell * to_call, Cell * arguments, Cell * env, Cell * reusable, bool checked);
+	Cell * arithmetic(char op, Cell * a, Cell * b);
+	Cell * square_root(Cell * a);
+	Cell * numbers_equal(Cell * a, Cell * b);
+	Cell * vector_builtin(Special_Form form, Cell ** args);
+	Cell * parallel_builtin(Special_Form form, Cell ** args);
+	void   print_value(Cell * a);
 	Cell * throw_error(char * format, ...); // returns NULL for convenience
 	void display_error();
 };
 
-Cell * alloc_cell();
+void   init_heap(Lisp_VM * vm);
+void   free_heap(Lisp_VM * vm);
+void   adopt_heap(Lisp_VM * vm, Lisp_VM * from); // Moves from's old space into vm's
+Cell * alloc_cell(Lisp_VM * vm, Cell_Type type);
+void   note_payload(Lisp_VM * vm, Cell * cell); // After attaching out-of-slab storage
+
+/* Must follow any store of value into a cell that may already be old,
+ * so a minor collection can find the pointer into the nursery. Cells
+ * fresh from alloc_cell with no allocation since don't need it.
+ */
+inline void write_barrier(Lisp_VM * vm, Cell * owner, Cell * value)
+{
+	if (is_young(value) && !is_young(owner)) vm->remember(owner);
+}
+Cell * make_number(Lisp_VM * vm, int number);
+Cell * alloc_environment(Lisp_VM * vm, Cell * parent, Cell * params, int count);
+Cell * alloc_vector(Lisp_VM * vm, int length);
+int    vector_form_arity(Special_Form form); // -1 for anything else
+int    parallel_form_arity(Special_Form form); // -1 for anything else
+void   free_future(Future * future);
+void   free_futures(Lisp_VM * vm); // After free_heap
+char * arity_text(int arity);
 void print_cell_as_lisp(Lisp_VM * vm, Cell * cell, bool first_cons = true);
 
-Cell * cell_push(Lisp_VM * vm, Cell * cell, Cell * to_push);
 int    list_length(Lisp_VM * vm, Cell * cell);
 Cell * list_index(Lisp_VM * vm, Cell * start, int index);
+Cell * reuse_cons(Lisp_VM * vm, Cell * original, Cell * car, Cell * cdr);
+Cell * optimize(Lisp_VM * vm, Cell * form);
+
+// Both return false and throw on failure (see image.cc)
+bool   save_image(Lisp_VM * vm, char * path);
+bool   load_image(Lisp_VM * vm, char * path);
 
-Cell * deep_copy_cell(Lisp_VM * vm, Cell * to_copy);
 
 #endif